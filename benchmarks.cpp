@@ -0,0 +1,666 @@
+#include "src/Image.h"
+#include "src/Scene.h"
+#include "src/RayTracer.h"
+
+// Slab test of Ray::intersectAABB before the ray cached its inverse direction:
+// one division per slab and a swap when the direction is negative. It never
+// compares the x and y slabs together, so it reports some boxes the ray misses.
+bool slabTestDivision(const Ray& ray, const AABB& aabb, float tMax, float& tEntry) {
+    Vec3<float> tMinSlab = (aabb.getMinBound() - ray.getOrigin()) / ray.getDirection();
+    Vec3<float> tMaxSlab = (aabb.getMaxBound() - ray.getOrigin()) / ray.getDirection();
+
+    for (int i = 0; i < 3; i++) {
+        if (tMinSlab[i] > tMaxSlab[i])
+            std::swap(tMinSlab[i], tMaxSlab[i]);
+    }
+
+    float tFirstPoint = (tMinSlab[0] > tMinSlab[1]) ? tMinSlab[0] : tMinSlab[1];
+    float tSecondPoint = (tMaxSlab[0] < tMaxSlab[1]) ? tMaxSlab[0] : tMaxSlab[1];
+
+    if (tFirstPoint > tMaxSlab[2] || tMinSlab[2] > tSecondPoint)
+        return false;
+
+    if (tMinSlab[2] > tFirstPoint) tFirstPoint = tMinSlab[2];
+    if (tMaxSlab[2] < tSecondPoint) tSecondPoint = tMaxSlab[2];
+
+    if (tSecondPoint < 0.f || tFirstPoint > tMax)
+        return false;
+
+    tEntry = std::max(tFirstPoint, 0.f);
+    return true;
+}
+
+Vec3<float> randomPoint(Random& rng, float extent) {
+    return Vec3<float>(rng.nextFloat() - 0.5f, rng.nextFloat() - 0.5f, rng.nextFloat() - 0.5f) * (2.f * extent);
+}
+
+// Millions of ray-box tests per second, before and after caching the inverse
+// direction in the ray
+void benchmarkBoxTests(int numberOfRays, int numberOfBoxes, int repetitions) {
+    Random rng(1);
+    std::vector<AABB> boxes;
+    for (int i = 0; i < numberOfBoxes; i++) {
+        Vec3<float> center = randomPoint(rng, 1.f);
+        Vec3<float> halfSize = Vec3<float>(rng.nextFloat(), rng.nextFloat(), rng.nextFloat()) * 0.5f;
+        boxes.push_back(AABB(center - halfSize, center + halfSize));
+    }
+
+    std::vector<Ray> rays;
+    for (int i = 0; i < numberOfRays; i++) {
+        Vec3<float> origin = randomPoint(rng, 2.f);
+        rays.push_back(Ray(origin, normalize(randomPoint(rng, 0.5f) - origin)));
+    }
+
+    double tests = (double) numberOfRays * numberOfBoxes * repetitions;
+    long long hitsDivision = 0, hitsCached = 0;
+    float entrySum = 0.f;
+
+    double start = omp_get_wtime();
+    for (int r = 0; r < repetitions; r++) {
+        for (const Ray& ray: rays) {
+            for (const AABB& box: boxes) {
+                float tEntry;
+                if (slabTestDivision(ray, box, std::numeric_limits<float>::max(), tEntry)) {
+                    hitsDivision++;
+                    entrySum += tEntry;
+                }
+            }
+        }
+    }
+    double timeDivision = omp_get_wtime() - start;
+
+    start = omp_get_wtime();
+    for (int r = 0; r < repetitions; r++) {
+        for (const Ray& ray: rays) {
+            for (const AABB& box: boxes) {
+                float tEntry;
+                if (ray.intersectAABB(box, tEntry)) {
+                    hitsCached++;
+                    entrySum += tEntry;
+                }
+            }
+        }
+    }
+    double timeCached = omp_get_wtime() - start;
+
+    std::cout << "benchmarks.cpp" << std::endl;
+    std::cout << "      Ray-box tests:              " << tests << std::endl;
+    std::cout << "      Hit ratio:                  " << hitsCached / tests << std::endl;
+    std::cout << "      False hits of the division: " << hitsDivision - hitsCached << std::endl;
+    std::cout << "      Division slab (Mtests/s):   " << tests / timeDivision * 1e-6 << std::endl;
+    std::cout << "      Cached slab (Mtests/s):     " << tests / timeCached * 1e-6 << std::endl;
+    std::cout << "      Speedup:                    " << timeDivision / timeCached << std::endl;
+    std::cout << "      (checksum " << entrySum << ")" << std::endl;
+}
+
+// HemisphereMapping::sampleDirection before the Fenwick tree: the grid is
+// normalized and summed into a new cumulative array, then scanned
+int sampleLinear(const HemisphereMapping& mapping, Random& rng) {
+    std::vector<float> cumulative(mapping.size());
+    float sum = 0.f;
+    for (std::size_t i = 0; i < mapping.size(); i++) {
+        sum += mapping.getValue(i);
+        cumulative[i] = sum;
+    }
+
+    float r = rng.nextFloat() * sum;
+    for (std::size_t i = 0; i < cumulative.size(); i++)
+        if (r < cumulative[i])
+            return i;
+    return mapping.size() - 1;
+}
+
+// Millions of hemisphere samples per second, each one following an update of
+// the grid as in learning light transport
+void benchmarkHemisphereSampling(int resX, int resY, int numberOfSamples) {
+    HemisphereMapping mapping(resX, resY);
+    Random rng(1);
+
+    // Same updates for both samplers
+    std::vector<int> updates(numberOfSamples);
+    std::vector<float> targets(numberOfSamples);
+    for (int i = 0; i < numberOfSamples; i++) {
+        updates[i] = rng.nextUInt() % mapping.size();
+        targets[i] = 10.f * rng.nextFloat();
+    }
+
+    long long checksum = 0;
+    float directionSum = 0.f;
+    double start = omp_get_wtime();
+    for (int i = 0; i < numberOfSamples; i++) {
+        mapping.updateByIndex(updates[i], targets[i], 0.25f);
+        int index = sampleLinear(mapping, rng);
+        directionSum += mapping.getDir(index, rng)[2];
+        checksum += index;
+    }
+    double timeLinear = omp_get_wtime() - start;
+
+    start = omp_get_wtime();
+    for (int i = 0; i < numberOfSamples; i++) {
+        mapping.updateByIndex(updates[i], targets[i], 0.25f);
+        HemisphereSampling::Sample s;
+        mapping.sampleDirection(s, rng);
+        directionSum += s.direction[2];
+        checksum += s.index;
+    }
+    double timeTree = omp_get_wtime() - start;
+
+    // Both samplers should pick the values in the same proportions
+    Random rngLinear(2), rngTree(2);
+    std::vector<int> countLinear(mapping.size(), 0), countTree(mapping.size(), 0);
+    for (int i = 0; i < numberOfSamples; i++) {
+        countLinear[sampleLinear(mapping, rngLinear)]++;
+        HemisphereSampling::Sample s;
+        mapping.sampleDirection(s, rngTree);
+        countTree[s.index]++;
+    }
+    int maxDifference = 0;
+    for (std::size_t i = 0; i < mapping.size(); i++)
+        maxDifference = std::max(maxDifference, std::abs(countLinear[i] - countTree[i]));
+
+    std::cout << "benchmarks.cpp" << std::endl;
+    std::cout << "      Hemisphere grid:            " << resX << "x" << resY << std::endl;
+    std::cout << "      Linear scan (Msamples/s):   " << numberOfSamples / timeLinear * 1e-6 << std::endl;
+    std::cout << "      Fenwick tree (Msamples/s):  " << numberOfSamples / timeTree * 1e-6 << std::endl;
+    std::cout << "      Speedup:                    " << timeLinear / timeTree << std::endl;
+    std::cout << "      Max count difference:       " << maxDifference << " / " << numberOfSamples << std::endl;
+    std::cout << "      (checksum " << checksum << " " << directionSum << ")" << std::endl;
+}
+
+// Millions of Q-table updates per second, with the BRDF evaluated for every cell
+// of the hemisphere and with the table of the material
+void benchmarkQtableUpdates(int numberOfLeaves, int numberOfUpdates) {
+    std::vector<Vec3<float>> vertices = {Vec3<float>(0, 0, 0), Vec3<float>(1, 0, 0), Vec3<float>(0, 1, 0)};
+    std::vector<Vec3<int>> indices = {Vec3<int>(0, 1, 2)};
+    Model model(vertices, indices);
+    model.setMaterial(Material(Vec3<float>(0.95, 0.55, 0.55), 0.6f, 0.40f, 0.5f, 0.2f));
+    std::vector<Model*> models = {&model};
+
+    double start = omp_get_wtime();
+    Qtable tabulated(models, numberOfLeaves, 10, 20, 0.25f);
+    double timeTables = omp_get_wtime() - start;
+    Qtable evaluated(std::vector<Model*>(), numberOfLeaves, 10, 20, 0.25f);
+    int cells = tabulated.getMapping(0).size();
+
+    // Same updates for both tables
+    Random rng(1);
+    std::vector<int> leaves(2 * numberOfUpdates), cellIndices(numberOfUpdates);
+    std::vector<Vec3<float>> irradiance(numberOfUpdates);
+    for (int i = 0; i < numberOfUpdates; i++) {
+        leaves[2*i] = rng.nextUInt() % numberOfLeaves;
+        leaves[2*i + 1] = rng.nextUInt() % numberOfLeaves;
+        cellIndices[i] = rng.nextUInt() % cells;
+        irradiance[i] = Vec3<float>(rng.nextFloat(), rng.nextFloat(), rng.nextFloat());
+    }
+
+    start = omp_get_wtime();
+    for (int i = 0; i < numberOfUpdates; i++)
+        evaluated.update(leaves[2*i], leaves[2*i + 1], cellIndices[i], irradiance[i], model.getMaterial(), rng);
+    double timeEvaluated = omp_get_wtime() - start;
+
+    start = omp_get_wtime();
+    for (int i = 0; i < numberOfUpdates; i++)
+        tabulated.update(leaves[2*i], leaves[2*i + 1], cellIndices[i], irradiance[i], model.getMaterial(), rng);
+    double timeTabulated = omp_get_wtime() - start;
+
+    // Both tables should learn the same values, up to the noise of the evaluated integrals
+    double difference = 0., total = 0.;
+    for (int leaf = 0; leaf < numberOfLeaves; leaf++) {
+        for (int i = 0; i < cells; i++) {
+            difference += std::abs(tabulated.getMapping(leaf).getValue(i) - evaluated.getMapping(leaf).getValue(i));
+            total += evaluated.getMapping(leaf).getValue(i);
+        }
+    }
+
+    std::cout << "benchmarks.cpp" << std::endl;
+    std::cout << "      Q-table updates:            " << numberOfUpdates << " (" << numberOfLeaves << " leaves)" << std::endl;
+    std::cout << "      Table setup (s):            " << timeTables << std::endl;
+    std::cout << "      BRDF per cell (Mupdates/s): " << numberOfUpdates / timeEvaluated * 1e-6 << std::endl;
+    std::cout << "      BRDF table (Mupdates/s):    " << numberOfUpdates / timeTabulated * 1e-6 << std::endl;
+    std::cout << "      Speedup:                    " << timeEvaluated / timeTabulated << std::endl;
+    std::cout << "      Relative difference:        " << difference / total << std::endl;
+}
+
+// Time and SAH cost of bringing the BVH of an animated model up to date, rebuilt
+// every frame and refitted (then rebuilt past the threshold). The model is
+// stretched a little more each frame, so that the refitted tree degrades.
+void benchmarkBVHRefit(const std::string& filename, int frames, float rebuildThreshold) {
+    Model model(filename);
+    std::vector<Model*> models = {&model};
+    std::vector<Instance*> instances;
+    SceneBVH::Settings settings;
+    settings.minSplit = 10;
+    settings.splitMethod = BVH::SplitMethod::SAH;
+
+    SceneBVH rebuilt, refitted;
+    double timeRebuilt = 0., timeRefitted = 0., costRebuilt = 0., costRefitted = 0.;
+    for (int frame = 0; frame < frames; frame++) {
+        rebuilt.update(models, instances, true, settings, 0.f);
+        refitted.update(models, instances, true, settings, rebuildThreshold);
+        // The first frame builds both
+        if (frame > 0) {
+            timeRebuilt += rebuilt.getUpdateTime();
+            timeRefitted += refitted.getUpdateTime();
+            costRebuilt += rebuilt.getBVH()->getSAHCost();
+            costRefitted += refitted.getBVH()->getSAHCost();
+        }
+        model.scale(Vec3<float>(1.f, 1.1f, 0.95f));
+        model.translate(Vec3<float>(0.05f, 0.f, 0.f));
+    }
+
+    std::cout << "benchmarks.cpp" << std::endl;
+    std::cout << "      Animated BVH:               " << filename << " (" << model.getIndices().size()
+              << " triangles, " << frames << " frames)" << std::endl;
+    std::cout << "      Rebuild per frame (ms):     " << timeRebuilt / (frames - 1) * 1000. << std::endl;
+    std::cout << "      Refit per frame (ms):       " << timeRefitted / (frames - 1) * 1000.
+              << " (rebuilt past " << rebuildThreshold << "x the SAH cost)" << std::endl;
+    std::cout << "      Speedup:                    " << timeRebuilt / timeRefitted << std::endl;
+    std::cout << "      Mean SAH cost:              " << costRefitted / (frames - 1)
+              << " refitted, " << costRebuilt / (frames - 1) << " rebuilt" << std::endl;
+}
+
+// Height field of size x size quads, two triangles each
+Model syntheticMesh(int size) {
+    std::vector<Vec3<float>> vertices;
+    std::vector<Vec3<int>> indices;
+    vertices.reserve((std::size_t) (size + 1) * (size + 1));
+    indices.reserve((std::size_t) 2 * size * size);
+    for (int y = 0; y <= size; y++)
+        for (int x = 0; x <= size; x++)
+            vertices.emplace_back((float) x / size, (float) y / size,
+                                  0.05f * std::sin(20.f * x / size) * std::cos(20.f * y / size));
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            int v = y * (size + 1) + x;
+            indices.emplace_back(v, v + 1, v + size + 2);
+            indices.emplace_back(v, v + size + 2, v + size + 1);
+        }
+    }
+    return Model(vertices, indices);
+}
+
+// Build time of the BVH of a model with both split methods, on one thread and on
+// every thread. The subtrees are built by OpenMP tasks.
+void benchmarkBVHBuild(const std::string& name, Model& model) {
+    std::vector<Model*> models = {&model};
+    int threads = omp_get_max_threads();
+    double times[2][2];
+    for (int method = 0; method < 2; method++) {
+        BVH::SplitMethod splitMethod = method == 0 ? BVH::SplitMethod::Middle : BVH::SplitMethod::SAH;
+        for (int parallel = 0; parallel < 2; parallel++) {
+            omp_set_num_threads(parallel ? threads : 1);
+            double start = omp_get_wtime();
+            BVH bvh(models, 10, splitMethod);
+            times[method][parallel] = omp_get_wtime() - start;
+        }
+    }
+    omp_set_num_threads(threads);
+
+    double triangles = model.getIndices().size();
+    std::cout << "benchmarks.cpp" << std::endl;
+    std::cout << "      BVH build:                  " << name << " (" << (std::size_t) triangles << " triangles)" << std::endl;
+    for (int method = 0; method < 2; method++) {
+        std::cout << (method == 0 ? "      Middle (s):                 " : "      SAH (s):                    ")
+                  << times[method][0] << " (1 thread), " << times[method][1] << " (" << threads << " threads)" << std::endl;
+        std::cout << "        Mtriangles/s:             " << triangles / times[method][1] * 1e-6
+                  << ", speedup " << times[method][0] / times[method][1] << std::endl;
+    }
+}
+
+// Regression checks: each prints OK or FAILED, and runBenchmarks() returns 1
+// when one of them failed
+int failedChecks = 0;
+
+void check(bool passed, const std::string& name) {
+    std::cout << "      " << std::left << std::setw(29) << name + ":" << std::right
+              << (passed ? "OK" : "FAILED") << std::endl;
+    if (!passed)
+        failedChecks++;
+}
+
+// Rays parallel to a face of a box, starting on its plane: the slab test gets
+// 0 * inf = NaN for that plane, the ray lies in the face and enters the box
+void checkAxisAlignedRays() {
+    AABB box;
+    box.update(Vec3<float>(0.f, 0.f, 0.f));
+    box.update(Vec3<float>(1.f, 1.f, 1.f));
+
+    std::cout << "benchmarks.cpp" << std::endl;
+    for (float zero: {0.f, -0.f}) {
+        std::string sign = std::signbit(zero) ? " (-0)" : " (+0)";
+        float tEntry = -1.f;
+        Ray onMinFace(Vec3<float>(0.f, 0.5f, -1.f), Vec3<float>(zero, 0.f, 1.f));
+        check(onMinFace.intersectAABB(box, tEntry) && tEntry == 1.f, "Ray on the min face" + sign);
+        Ray onMaxFace(Vec3<float>(1.f, 0.5f, -1.f), Vec3<float>(zero, 0.f, 1.f));
+        check(onMaxFace.intersectAABB(box, tEntry) && tEntry == 1.f, "Ray on the max face" + sign);
+        Ray onEdge(Vec3<float>(1.f, 1.f, -1.f), Vec3<float>(zero, zero, 1.f));
+        check(onEdge.intersectAABB(box, tEntry) && tEntry == 1.f, "Ray on an edge" + sign);
+        Ray outside(Vec3<float>(-0.001f, 0.5f, -1.f), Vec3<float>(zero, 0.f, 1.f));
+        check(!outside.intersectAABB(box, tEntry), "Ray beside the box" + sign);
+    }
+}
+
+// A model whose faces were all dropped by the loader gives a BVH whose root is a leaf
+// without triangles, which must be traced as a leaf
+void checkEmptyModel() {
+    Model empty({Vec3<float>(0.f, 0.f, 0.f), Vec3<float>(1.f, 0.f, 0.f), Vec3<float>(0.f, 1.f, 0.f)}, {});
+    std::vector<Model*> models = {&empty};
+    for (bool wide: {false, true}) {
+        BVH bvh(models, 2, BVH::SplitMethod::SAH, wide);
+        Ray ray(Vec3<float>(0.f, 0.f, 1.f), Vec3<float>(0.f, 0.f, -1.f));
+        std::vector<Ray> rays(RayPacket::size, ray);
+        RayPacket packet(rays.data(), rays.size());
+        Ray::Hit hit, hits[RayPacket::size];
+        bool found[RayPacket::size];
+        bvh.intersect(packet, hits, found);
+        check(!bvh.intersect(ray, hit) && !found[0], wide ? "Empty model (wide)" : "Empty model");
+    }
+}
+
+// Inputs the heuristics can't split well must still build: a chain of triangles of
+// growing sizes, which the splits peel off one at a time far deeper than the depth
+// limit, and more coincident triangles than a leaf can count. Every split method must
+// find the hits of the model itself.
+void checkDegenerateBuilds() {
+    std::vector<Vec3<float>> vertices;
+    std::vector<Vec3<int>> indices;
+    for (int k = 0; k < 150; k++) {
+        float x = std::ldexp(1.f, -k), size = 0.25f * x;
+        vertices.emplace_back(x, -size, 0.f);
+        vertices.emplace_back(x, size, -size);
+        vertices.emplace_back(x, size, size);
+        indices.emplace_back(3 * k, 3 * k + 1, 3 * k + 2);
+    }
+    Model chain(vertices, indices);
+    Model coincident({Vec3<float>(0.f, -1.f, -1.f), Vec3<float>(0.f, 1.f, -1.f), Vec3<float>(0.f, 0.f, 1.f)},
+                     std::vector<Vec3<int>>(70000, Vec3<int>(0, 1, 2)));
+
+    for (Model* model: {&chain, &coincident}) {
+        std::vector<Model*> models = {model};
+        std::vector<Ray> rays;
+        Random rng(1);
+        for (int k = 0; k < 300; k++) {
+            float x = model == &chain ? std::ldexp(1.f, -(k % 150)) : 0.f;
+            float size = model == &chain ? 0.25f * x : 1.f;
+            Vec3<float> target(x, size * (rng.nextFloat() - 0.5f), size * (rng.nextFloat() - 0.5f));
+            Vec3<float> origin(-1.f, 0.f, 0.f);
+            rays.emplace_back(origin, normalize(target - origin));
+        }
+
+        for (BVH::SplitMethod splitMethod: {BVH::SplitMethod::Middle, BVH::SplitMethod::SAH}) {
+            bool built = true;
+            int different = 0;
+            try {
+                BVH bvh(models, 1, splitMethod);
+                for (const Ray& ray: rays) {
+                    Ray bvhRay = ray, modelRay = ray;
+                    Ray::Hit bvhHit, modelHit;
+                    bool bvhFound = bvh.intersect(bvhRay, bvhHit);
+                    bool modelFound = modelRay.intersect(*model, modelHit);
+                    different += bvhFound != modelFound
+                                 || (bvhFound && std::abs(bvhHit.distance - modelHit.distance) > 1e-5f * modelHit.distance);
+                }
+            } catch (const std::length_error&) {
+                built = false;
+            }
+            std::string name = std::string(model == &chain ? "Deep chain" : "Coincident")
+                             + (splitMethod == BVH::SplitMethod::SAH ? " (SAH)" : " (Middle)");
+            check(built && different == 0, name);
+        }
+    }
+}
+
+// Axis-aligned unit cubes at integer positions, two triangles per face
+Model cubes(const std::vector<Vec3<float>>& positions) {
+    static const int faces[6][4] = {{0, 2, 3, 1}, {4, 5, 7, 6}, {0, 1, 5, 4}, {2, 6, 7, 3}, {0, 4, 6, 2}, {1, 3, 7, 5}};
+    std::vector<Vec3<float>> vertices;
+    std::vector<Vec3<int>> indices;
+    for (const Vec3<float>& p: positions) {
+        int first = vertices.size();
+        for (int k = 0; k < 8; k++)
+            vertices.push_back(p + Vec3<float>(k & 1, (k >> 1) & 1, (k >> 2) & 1));
+        for (const auto& f: faces) {
+            indices.emplace_back(first + f[0], first + f[1], first + f[2]);
+            indices.emplace_back(first + f[0], first + f[2], first + f[3]);
+        }
+    }
+    return Model(vertices, indices);
+}
+
+// The wide and packet traversals must find the closest hits of the binary one, including
+// for rays with zero direction components running along the faces of the boxes. Two
+// triangles sharing an edge may both be at the closest distance, so only the distances
+// are compared.
+void checkTraversals() {
+    std::vector<Vec3<float>> positions;
+    for (int x = -2; x <= 1; x++)
+        for (int y = -2; y <= 1; y++)
+            if ((x + y) % 2 == 0)
+                positions.emplace_back(x, y, -4.f + x);
+    Model model = cubes(positions);
+    std::vector<Model*> models = {&model};
+
+    // Camera rays whose centre column and row have 0 components, then rays along the
+    // axes starting on the planes of the faces, then random rays
+    std::vector<Ray> rays;
+    for (int j = -15; j <= 15; j++)
+        for (int i = -15; i <= 15; i++)
+            rays.emplace_back(Vec3<float>(0.f, 0.f, 2.f), normalize(Vec3<float>(i / 10.f, j / 10.f, -1.f)));
+    for (int axis = 0; axis < 3; axis++)
+        for (int a = -6; a <= 6; a++)
+            for (int b = -6; b <= 6; b++)
+                for (float direction: {1.f, -1.f, 0.f, -0.f}) {
+                    Vec3<float> origin, d(0.f, 0.f, 0.f);
+                    origin[axis] = 6.f * (direction > 0.f ? -1.f : 1.f);
+                    origin[(axis + 1) % 3] = a / 2.f;
+                    origin[(axis + 2) % 3] = b / 2.f - 2.f;
+                    d[axis] = direction == 0.f ? -1.f : direction;
+                    d[(axis + 1) % 3] = direction == 0.f ? direction : 0.f;
+                    rays.emplace_back(origin, d);
+                }
+    Random rng(1);
+    for (int k = 0; k < 2000; k++)
+        rays.emplace_back(randomPoint(rng, 5.f), normalize(randomPoint(rng, 1.f)));
+
+    std::cout << "benchmarks.cpp" << std::endl;
+    std::cout << "      Traversal rays:              " << rays.size() << std::endl;
+    for (bool watertight: {false, true}) {
+        BVH binary(models, 2, BVH::SplitMethod::SAH, false, watertight);
+        BVH wide(models, 2, BVH::SplitMethod::SAH, true, watertight);
+        auto sameHit = [](bool foundA, const Ray::Hit& a, bool foundB, const Ray::Hit& b) {
+            return foundA == foundB && (!foundA || a.distance == b.distance);
+        };
+
+        int differentWide = 0, differentPacket = 0;
+        for (std::size_t k = 0; k < rays.size(); k += RayPacket::size) {
+            int count = std::min((int) (rays.size() - k), RayPacket::size);
+            Ray::Hit hits[RayPacket::size];
+            bool found[RayPacket::size];
+            std::vector<Ray> packetRays(rays.begin() + k, rays.begin() + k + count);
+            RayPacket packet(packetRays.data(), count);
+            binary.intersect(packet, hits, found);
+
+            for (int j = 0; j < count; j++) {
+                Ray binaryRay = rays[k + j], wideRay = rays[k + j];
+                Ray::Hit binaryHit, wideHit;
+                bool binaryFound = binary.intersect(binaryRay, binaryHit);
+                differentWide += !sameHit(binaryFound, binaryHit, wide.intersect(wideRay, wideHit), wideHit);
+                differentPacket += !sameHit(binaryFound, binaryHit, found[j], hits[j]);
+            }
+        }
+
+        std::string test = watertight ? " (watertight)" : "";
+        check(differentWide == 0, "Wide BVH hits" + test);
+        check(differentPacket == 0, "Packet hits" + test);
+    }
+}
+
+// Mean of the pixels of a small path traced room around the camera, lit by a small and
+// bright emissive slab: few paths reach it, so the samples are mostly dark with rare
+// bright outliers. Averaged over the given number of seeds.
+double meanRadiance(int minSpp, int budgetSpp, int seeds) {
+    Model room = cubes({Vec3<float>(0.f, 0.f, 0.f)});
+    room.scale(Vec3<float>(4.f, 3.f, 8.f));
+    room.translate(Vec3<float>(-2.f, -1.5f, -6.f));
+    room.setMaterial(Material(Vec3<float>(0.8, 0.8, 0.8), 1.f, 0.4f));
+    Model box = cubes({Vec3<float>(0.f, 0.f, 0.f)});
+    box.scale(Vec3<float>(0.8f, 0.8f, 0.8f));
+    box.translate(Vec3<float>(-1.f, -1.5f, -4.5f));
+    box.setMaterial(Material(Vec3<float>(0.95, 0.55, 0.55), 0.6f, 0.4f, 0.5f, 0.2f));
+    Model light = cubes({Vec3<float>(0.f, 0.f, 0.f)});
+    light.scale(Vec3<float>(0.25f, 0.02f, 0.25f));
+    light.translate(Vec3<float>(-0.125f, 1.4f, -4.125f));
+    light.setMaterial(Material(Vec3<float>(1.0, 1.0, 1.0), 1.f, 0.1f, 0.0f, 10.0f));
+    Scene scene;
+    scene.add(room);
+    scene.add(box);
+    scene.add(light);
+
+    double mean = 0.;
+    for (int seed = 0; seed < seeds; seed++) {
+        Image img(60, 40);
+        RayTracer rt;
+        rt.enableBVH(10);
+        rt.enablePathTracing(3, budgetSpp);
+        rt.enableAdaptiveSampling(minSpp, budgetSpp);
+        rt.setSeed(seed);
+        rt.render(img, scene);
+        for (int j = 0; j < img.getHeight(); j++)
+            for (int i = 0; i < img.getWidth(); i++)
+                mean += AccumulationBuffer::luminance(img(i, j));
+    }
+    return mean / (seeds * 60 * 40);
+}
+
+// Adaptive sampling moves samples between pixels but must not change the expected
+// image: its mean matches the one of uniform sampling at the same budget. The uniform
+// reference takes the whole budget as minimum samples, with the random positions in the
+// pixel of adaptive sampling rather than the fixed grid of pathTrace().
+void checkAdaptiveSampling() {
+    int budgetSpp = 16, seeds = 64;
+    double uniform = meanRadiance(budgetSpp, budgetSpp, seeds);
+    std::cout << "benchmarks.cpp" << std::endl;
+    std::cout << "      Uniform mean:                " << uniform << std::endl;
+    for (int minSpp: {4, 8}) {
+        double adaptive = meanRadiance(minSpp, budgetSpp, seeds);
+        std::string name = "Adaptive mean (" + std::to_string(minSpp) + " min spp)";
+        std::cout << "benchmarks.cpp" << std::endl;
+        std::cout << "      " << std::left << std::setw(29) << name + ":" << std::right << adaptive << std::endl;
+        check(std::abs(adaptive - uniform) < 0.05 * uniform, name);
+    }
+}
+
+// After a long sequence of updates, the directions must still be sampled with the
+// probabilities that sampleDirection() and probability() report: the values first grow
+// large, then settle much lower, as when learning moves away from a bright direction.
+void checkHemisphereSampling() {
+    HemisphereMapping mapping(10, 20);
+    Random rng(1);
+    for (int i = 0; i < 20000000; i++)
+        mapping.updateByIndex(rng.nextUInt() % mapping.size(), 1000.f * rng.nextFloat(), 0.1f);
+    for (int i = 0; i < 2000000; i++)
+        mapping.updateByIndex(rng.nextUInt() % mapping.size(), 0.05f * (1.f + rng.nextFloat()), 0.1f);
+
+    int numberOfSamples = 2000000;
+    std::vector<int> count(mapping.size(), 0);
+    for (int i = 0; i < numberOfSamples; i++) {
+        HemisphereSampling::Sample s;
+        mapping.sampleDirection(s, rng);
+        count[s.index]++;
+    }
+
+    // Relative difference between the frequency of each cell and its probability
+    float maxDifference = 0.f;
+    for (std::size_t i = 0; i < mapping.size(); i++) {
+        float probability = mapping.probability(mapping.getDir(i, 0.5f, 0.5f)) * 2.f * M_PI / mapping.size();
+        float frequency = count[i] / (float) numberOfSamples;
+        maxDifference = std::max(maxDifference, std::abs(frequency - probability) / probability);
+    }
+
+    std::cout << "benchmarks.cpp" << std::endl;
+    std::cout << "      Max frequency difference:    " << maxDifference << std::endl;
+    check(maxDifference < 0.1f, "Hemisphere sampling pdf");
+}
+
+// A snapshot restores the leaves of the same scene, the leaves of the models left
+// untouched in a modified scene, and none of a scene whose triangles differ even
+// though its leaves have the same rounded bounds and numbers of triangles
+void checkQtableSnapshots() {
+    auto restoredLeaves = [](const std::vector<Vec3<float>>& saved, const std::vector<Vec3<float>>& loaded) {
+        const std::string filename = "qtable_check.bin";
+        Model savedModel = cubes(saved), loadedModel = cubes(loaded);
+        std::vector<Model*> savedModels = {&savedModel}, loadedModels = {&loadedModel};
+        BVH savedBvh(savedModels, 12), loadedBvh(loadedModels, 12);
+        Qtable savedTable(savedModels, savedBvh.getNumberOfLeaves(), 10, 20, 0.25f);
+        Qtable loadedTable(loadedModels, loadedBvh.getNumberOfLeaves(), 10, 20, 0.25f);
+        savedTable.save(filename, savedBvh, 1);
+        int restored = loadedTable.load(filename, loadedBvh, saved == loaded ? 1 : 2);
+        std::remove(filename.c_str());
+        return restored;
+    };
+
+    std::vector<Vec3<float>> scene = {Vec3<float>(0.f, 0.f, -4.f), Vec3<float>(3.f, 0.f, -4.f)};
+    std::vector<Vec3<float>> modified = {Vec3<float>(0.f, 0.f, -4.f), Vec3<float>(3.f, 1.f, -4.f)};
+    std::vector<Vec3<float>> shifted = {Vec3<float>(1e-4f, 0.f, -4.f), Vec3<float>(3.f + 1e-4f, 0.f, -4.f)};
+    check(restoredLeaves(scene, scene) == 2, "Snapshot, same scene");
+    check(restoredLeaves(scene, modified) == 1, "Snapshot, modified scene");
+    check(restoredLeaves(scene, shifted) == 0, "Snapshot, other scene");
+}
+
+// A scaled instance must take the same rays as parallel to its triangles as its mesh
+// transformed in place. The rays graze a small square: at this scale, the determinants
+// of the world space tests come close to the epsilon of the rays.
+void checkScaledInstance() {
+    Model mesh({Vec3<float>(0.f, 0.f, 0.f), Vec3<float>(1.f, 0.f, 0.f), Vec3<float>(1.f, 1.f, 0.f), Vec3<float>(0.f, 1.f, 0.f)},
+               {Vec3<int>(0, 1, 2), Vec3<int>(0, 2, 3)});
+    float scale = 0.02f;
+    Model placed = mesh;
+    placed.scale(Vec3<float>(scale, scale, scale));
+    placed.translate(Vec3<float>(0.f, 0.f, -1.f));
+    Instance instance(mesh, Transform::translation(Vec3<float>(0.f, 0.f, -1.f))
+                            * Transform::scaling(Vec3<float>(scale, scale, scale)));
+    std::vector<Model*> models = {&placed};
+    std::vector<Instance*> instances = {&instance};
+    BVH bvh(models, 2);
+    InstanceBVH instanceBvh(instances, 2);
+
+    // Directions between 0.001 and 0.05 radians above the plane of the square
+    Random rng(1);
+    int different = 0, numberOfRays = 10000;
+    for (int k = 0; k < numberOfRays; k++) {
+        Vec3<float> target(scale * (0.1f + 0.8f * rng.nextFloat()), scale * (0.1f + 0.8f * rng.nextFloat()), -1.f);
+        float elevation = 0.001f + 0.049f * rng.nextFloat(), azimuth = 2.f * M_PI * rng.nextFloat();
+        Vec3<float> direction(std::cos(elevation) * std::cos(azimuth), std::cos(elevation) * std::sin(azimuth),
+                              -std::sin(elevation));
+        Ray placedRay(target - 0.01f * direction, direction), instanceRay = placedRay;
+        Ray::Hit placedHit, instanceHit;
+        different += bvh.intersect(placedRay, placedHit) != instanceBvh.intersect(instanceRay, instanceHit);
+    }
+
+    std::cout << "benchmarks.cpp" << std::endl;
+    std::cout << "      Different instance hits:     " << different << " / " << numberOfRays << std::endl;
+    check(different == 0, "Scaled instance hits");
+}
+
+int runBenchmarks(int argc, char *argv[]) {
+    checkAxisAlignedRays();
+    checkTraversals();
+    checkEmptyModel();
+    checkDegenerateBuilds();
+    checkAdaptiveSampling();
+    checkHemisphereSampling();
+    checkQtableSnapshots();
+    checkScaledInstance();
+    benchmarkBoxTests(1000, 1000, 20);
+    benchmarkHemisphereSampling(10, 20, 1000000);
+    benchmarkQtableUpdates(100, 200000);
+    benchmarkBVHRefit("../models/face.off", 20, 1.3f);
+    for (std::string name: {"face.off", "face_lowres.off", "walls1.off", "smallcube.off"}) {
+        Model model("../models/" + name);
+        benchmarkBVHBuild(name, model);
+    }
+    Model synthetic = syntheticMesh(2237);    // 10M triangles
+    benchmarkBVHBuild("synthetic height field", synthetic);
+
+    return failedChecks > 0 ? 1 : 0;
+}
\ No newline at end of file
@@ -4,7 +4,8 @@
 #include "src/PointLight.h"
 #include "src/AreaLight.h"
 
-void learningScene1(int width, int height, std::string& filename) {
+// wavefront: render with the wavefront integrator instead of tracing each path at once
+void learningScene1(int width, int height, std::string& filename, bool wavefront=false) {
     // bottom color
     Vec3<float> bottom(0.15, 0.15, 0.15);
     // top color
@@ -57,12 +58,14 @@ void learningScene1(int width, int height, std::string& filename) {
     //rayTracer.enagleCosineWeighted();
     rayTracer.enableLearningLT();
     rayTracer.enablePathTracing(3, 144);
+    if (wavefront)
+        rayTracer.enableWavefront();
     rayTracer.printInfos();
     rayTracer.render(img, scene);
     img.savePPM(filename);
 }
 
-void learningScene2(int width, int height, std::string& filename) {
+void learningScene2(int width, int height, std::string& filename, bool wavefront=false) {
     // bottom color
     Vec3<float> bottom(0.15, 0.15, 0.15);
     // top color
@@ -114,6 +117,8 @@ void learningScene2(int width, int height, std::string& filename) {
     //rayTracer.enagleCosineWeighted();
     rayTracer.enableLearningLT();
     rayTracer.enablePathTracing(3, 144);
+    if (wavefront)
+        rayTracer.enableWavefront();
     rayTracer.printInfos();
     rayTracer.render(img, scene);
     img.savePPM(filename);
@@ -124,9 +129,13 @@ int runExperiments(int argc, char *argv[]) {
     int height = 300;
     std::string filename1 = "scene1.ppm";
     std::string filename2 = "scene2.ppm";
+    std::string wavefrontFilename1 = "scene1_wavefront.ppm";
+    std::string wavefrontFilename2 = "scene2_wavefront.ppm";
 
     learningScene1(width, height, filename1);
     learningScene2(width, height, filename2);
+    learningScene1(width, height, wavefrontFilename1, true);
+    learningScene2(width, height, wavefrontFilename2, true);
 
     return 0;
 }
@@ -233,27 +233,27 @@ void TD6(int width, int height, std::string& filename) {
     // Add plane to scene
     scene.add(plane);
 
-    // Define a face1 model
-    Model face1("../models/face.off");
+    // The face mesh is loaded once, each face is an instance of it
+    Model face("../models/face.off");
+
+    // Define a face1 instance
+    Instance face1(face, Transform::translation(Vec3<float>(0.0f, 0.f, -2.f)));
     // Material face1Material(Vec3<float>(0.8, 0.6, 0.3), 0.8f, 0.40f);
     Material face1Material(Vec3<float>(0.15, 0.15, 0.15), 0.8f, 0.40f);
-    face1.translate(Vec3<float>(0.0f, 0.f, -2.f));
     face1.setMaterial(face1Material);
     // Add face to scene
     scene.add(face1);
 
-    // Define a face2 model
-    Model face2("../models/face.off");
+    // Define a face2 instance
+    Instance face2(face, Transform::translation(Vec3<float>(0.8f, 0.f, -1.5f)));
     Material face2Material(Vec3<float>(0.5, 0.9, 0.5), 0.8f, 0.40f);
-    face2.translate(Vec3<float>(0.8f, 0.f, -1.5f));
     face2.setMaterial(face2Material);
     // Add face to scene
     // scene.add(face2);
 
-    // Define a face3 model
-    Model face3("../models/face.off");
+    // Define a face3 instance
+    Instance face3(face, Transform::translation(Vec3<float>(-0.8f, 0.f, -2.5f)));
     Material face3Material(Vec3<float>(0.3, 0.6, 0.8), 0.8f, 0.40f);
-    face3.translate(Vec3<float>(-0.8f, 0.f, -2.5f));
     face3.setMaterial(face3Material);
     // Add face to scene
     // scene.add(face3);
@@ -5,46 +5,70 @@
 
 class AABB {
 public:
-    AABB(): minBound(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max()),
-            maxBound(-minBound)
-            {}
+    AABB() {
+        bounds[0] = Vec3<float>(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
+        bounds[1] = -bounds[0];
+    }
 
-    AABB(const Vec3<float>& minBound, const Vec3<float>& maxBound):
-        minBound(minBound), maxBound(maxBound) {}
+    AABB(const Vec3<float>& minBound, const Vec3<float>& maxBound) {
+        bounds[0] = minBound;
+        bounds[1] = maxBound;
+    }
 
-    AABB(const std::vector<Vec3<float>>& vertices) {
+    // Vertices in any container with operator[] and range-for, std::vector or ArrayView
+    template <typename Vertices>
+    explicit AABB(const Vertices& vertices) {
         compute(vertices);
     }
 
-    void compute(const std::vector<Vec3<float>>& vertices) {
-        minBound = vertices[0];
-        maxBound = vertices[0];
+    template <typename Vertices>
+    void compute(const Vertices& vertices) {
+        bounds[0] = vertices[0];
+        bounds[1] = vertices[0];
 
         for (const auto& v: vertices)
             update(v);
     }
 
     void update(const Vec3<float>& v) {
-        minBound[0] = std::min(v[0], minBound[0]);
-        minBound[1] = std::min(v[1], minBound[1]);
-        minBound[2] = std::min(v[2], minBound[2]);
+        bounds[0][0] = std::min(v[0], bounds[0][0]);
+        bounds[0][1] = std::min(v[1], bounds[0][1]);
+        bounds[0][2] = std::min(v[2], bounds[0][2]);
 
-        maxBound[0] = std::max(v[0], maxBound[0]);
-        maxBound[1] = std::max(v[1], maxBound[1]);
-        maxBound[2] = std::max(v[2], maxBound[2]);
+        bounds[1][0] = std::max(v[0], bounds[1][0]);
+        bounds[1][1] = std::max(v[1], bounds[1][1]);
+        bounds[1][2] = std::max(v[2], bounds[1][2]);
     }
 
     void update(const AABB& aabb) {
-        update(aabb.minBound);
-        update(aabb.maxBound);
+        if (aabb.isEmpty())
+            return;
+
+        update(aabb.bounds[0]);
+        update(aabb.bounds[1]);
+    }
+
+    bool isEmpty() const {
+        return bounds[0][0] > bounds[1][0];
     }
 
-    const Vec3<float>& getMinBound() const { return minBound; }
-    const Vec3<float>& getMaxBound() const { return maxBound; }
+    float surfaceArea() const {
+        if (isEmpty())
+            return 0.f;
+
+        Vec3<float> d = bounds[1] - bounds[0];
+        return 2.f * (d[0]*d[1] + d[0]*d[2] + d[1]*d[2]);
+    }
+
+    Vec3<float> getCentroid() const { return (bounds[0] + bounds[1]) / 2.f; }
+
+    const Vec3<float>& getMinBound() const { return bounds[0]; }
+    const Vec3<float>& getMaxBound() const { return bounds[1]; }
+    // 0: min bound, 1: max bound
+    const Vec3<float>& operator[](int i) const { return bounds[i]; }
 
 private:
-    Vec3<float> minBound;
-    Vec3<float> maxBound;
+    Vec3<float> bounds[2];  // min and max bounds
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,75 @@
+#ifndef ACCUMULATION_BUFFER_H
+#define ACCUMULATION_BUFFER_H
+
+#include <vector>
+#include "Vec3.h"
+#include "Image.h"
+
+/*
+* Running sum of the samples of each pixel, rendered over several passes.
+* The squared luminance is also summed to estimate the variance of each
+* pixel mean.
+*/
+class AccumulationBuffer {
+public:
+    AccumulationBuffer(int width, int height): width(width), height(height),
+                                               sum(width*height),
+                                               sumSquaredLuminance(width*height, 0.f),
+                                               count(width*height, 0) {}
+
+    void add(int x, int y, const Vec3<float>& sample) {
+        int k = x + y*width;
+        float l = luminance(sample);
+        sum[k] += sample;
+        sumSquaredLuminance[k] += l*l;
+        count[k]++;
+    }
+
+    Vec3<float> mean(int x, int y) const {
+        int k = x + y*width;
+        return count[k] > 0 ? sum[k] / (float) count[k] : Vec3<float>(0.f, 0.f, 0.f);
+    }
+
+    int getCount(int x, int y) const { return count[x + y*width]; }
+
+    // Variance of the mean luminance of the pixel
+    float variance(int x, int y) const {
+        int k = x + y*width;
+        int n = count[k];
+        if (n < 2)
+            return 0.f;
+
+        float meanLuminance = luminance(sum[k]) / n;
+        float sampleVariance = (sumSquaredLuminance[k] - n*meanLuminance*meanLuminance) / (n - 1);
+        return std::max(sampleVariance, 0.f) / n;
+    }
+
+    float meanVariance() const {
+        double total = 0.;
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++)
+                total += variance(x, y);
+
+        return total / (width*height);
+    }
+
+    void resolve(Image& img) const {
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++)
+                if (count[x + y*width] > 0)
+                    img(x, y) = mean(x, y);
+    }
+
+    static float luminance(const Vec3<float>& c) {
+        return 0.2126f*c[0] + 0.7152f*c[1] + 0.0722f*c[2];
+    }
+
+private:
+    int width;
+    int height;
+    std::vector<Vec3<float>> sum;
+    std::vector<float> sumSquaredLuminance;
+    std::vector<int> count;
+};
+
+#endif
\ No newline at end of file
@@ -1,7 +1,6 @@
 #ifndef AREALIGHT_H
 #define AREALIGHT_H
 
-#include <random>
 #include "Light.h"
 
 class AreaLight : public Light {
@@ -15,10 +14,10 @@ public:
             up = normalize(cross(n, right));
         }
 
-    Vec3<float> getPosition() const override {
+    Vec3<float> samplePosition(Random& rng) const override {
         // Random numbers between -0.5 and 0.5
-        float randomUp = (static_cast <float> (rand()) / static_cast <float> (RAND_MAX)) - 0.5f;
-        float randomRight = (static_cast <float> (rand()) / static_cast <float> (RAND_MAX)) - 0.5f;
+        float randomUp = rng.nextFloat() - 0.5f;
+        float randomRight = rng.nextFloat() - 0.5f;
 
         return position + randomUp*up*size + randomRight*right*size;
     }
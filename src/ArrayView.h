@@ -0,0 +1,33 @@
+#ifndef ARRAY_VIEW_H
+#define ARRAY_VIEW_H
+
+#include <vector>
+#include <cstddef>
+
+/*
+* Contiguous array owned by someone else: a std::vector or a mapped file.
+* Offers the read interface of std::vector, so that code walking the arrays of
+* a model does not depend on where they are stored.
+*/
+template <typename T>
+class ArrayView {
+public:
+    ArrayView(): ptr(nullptr), count(0) {}
+    ArrayView(T* data, std::size_t size): ptr(data), count(size) {}
+    ArrayView(std::vector<T>& v): ptr(v.data()), count(v.size()) {}
+
+    T* data() const { return ptr; }
+    std::size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    T& operator[](std::size_t i) const { return ptr[i]; }
+    T& back() const { return ptr[count - 1]; }
+    T* begin() const { return ptr; }
+    T* end() const { return ptr + count; }
+
+private:
+    T* ptr;
+    std::size_t count;
+};
+
+#endif
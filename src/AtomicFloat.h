@@ -0,0 +1,46 @@
+#ifndef ATOMIC_FLOAT_H
+#define ATOMIC_FLOAT_H
+
+#include <atomic>
+
+/*
+* Float or double shared between threads without locks. Updates are compare-and-swap
+* loops, so concurrent updates are never lost. Copies are not atomic, they
+* only let the values live in a std::vector.
+*/
+template <typename T>
+class AtomicValue {
+public:
+    AtomicValue(T v = 0): value(v) {}
+    AtomicValue(const AtomicValue& other): value(other.load()) {}
+    AtomicValue& operator=(const AtomicValue& other) {
+        store(other.load());
+        return *this;
+    }
+
+    T load() const { return value.load(std::memory_order_relaxed); }
+    void store(T v) { value.store(v, std::memory_order_relaxed); }
+
+    // Moves the value towards target by the given fraction, returns the change. The
+    // difference of two floats is exact in double, sums of changes then follow the value.
+    double blend(T target, T fraction) {
+        T old = load();
+        T updated = old + fraction * (target - old);
+        while (!value.compare_exchange_weak(old, updated, std::memory_order_relaxed))
+            updated = old + fraction * (target - old);
+        return (double) updated - (double) old;
+    }
+
+    void add(T delta) {
+        T old = load();
+        while (!value.compare_exchange_weak(old, old + delta, std::memory_order_relaxed));
+    }
+
+private:
+    std::atomic<T> value;
+};
+
+using AtomicFloat = AtomicValue<float>;
+using AtomicDouble = AtomicValue<double>;
+
+#endif
@@ -3,15 +3,18 @@
 
 #include <algorithm>
 #include <iomanip>
-#include <map>
+#include <cstdint>
 #include "Model.h"
 #include "AABB.h"
 #include "Ray.h"
+#include "RayPacket.h"
+#include "Hash.h"
 
 class BVH {
 public:
+    // Node of the tree used while building, flattened into LinearNodes afterwards
     struct Node {
-        Node(): size(0), left(nullptr), right(nullptr) {}
+        Node(): begin(0), size(0), axis(0), left(nullptr), right(nullptr) {}
         ~Node() {
             if (left)
                 delete left;
@@ -19,9 +22,10 @@ public:
                 delete right;
         }
 
-        // model_index -> triangles_indices
-        std::map<int, std::vector<int>> indices;
+        // Triangles of the node: buildOrder[begin, begin + size), split in place between the children
+        int begin;
         int size;
+        int axis;   // split axis
 
         AABB aabb;
 
@@ -29,99 +33,705 @@ public:
         Node* right;
     };
 
-    BVH(const std::vector<Model*>& models, int minSplit=100): root(new Node()),
-                                                          models(models),
-                                                          minSplit(minSplit),
-                                                          numberOfNodes(1) {
+    // Triangle referenced by a leaf
+    struct Primitive {
+        int model;  // index of the model
+        int index;  // index of the triangle in the model
+    };
+
+    // Node of the flattened tree, stored in depth-first order: the first child
+    // of an interior node directly follows it in the array
+    struct alignas(32) LinearNode {
+        AABB aabb;
+        union {
+            int primitivesOffset;   // leaf: first primitive in primitives
+            int secondChildOffset;  // interior: index of the second child
+        };
+        uint16_t nPrimitives;       // 0 for an interior node
+        uint8_t axis;               // interior: split axis
+        uint8_t leaf;               // 1 for a leaf, which may hold no triangle (empty models)
+
+        bool isLeaf() const { return leaf != 0; }
+    };
+    static_assert(sizeof(LinearNode) == 32, "LinearNode should fit in 32 bytes");
+
+    static constexpr int wideWidth = SIMD_WIDTH;
+    static constexpr int packetSize = SIMD_WIDTH;
+
+    // packetSize consecutive triangles of a leaf, first vertex and edges in structure
+    // of arrays so that one ray is tested against all of them at once. The first
+    // primitive of each leaf is aligned on a packet, unused lanes are degenerate.
+    struct alignas(32) TrianglePacket {
+        float v0x[packetSize], v0y[packetSize], v0z[packetSize];
+        float e1x[packetSize], e1y[packetSize], e1z[packetSize];
+        float e2x[packetSize], e2y[packetSize], e2z[packetSize];
+    };
+
+    // Same layout for the watertight test, which needs the vertices themselves:
+    // edges recomputed from v0 would not match between neighbouring triangles.
+    // Unused lanes are NaN.
+    struct alignas(32) WatertightPacket {
+        float v0[3][packetSize];
+        float v1[3][packetSize];
+        float v2[3][packetSize];
+    };
+
+    // Node of the collapsed tree (BVH4 with SSE, BVH8 with AVX2): the bounds of its
+    // children in structure of arrays, tested against a ray with one SIMD slab test
+    struct alignas(32) WideNode {
+        float minX[wideWidth], minY[wideWidth], minZ[wideWidth];
+        float maxX[wideWidth], maxY[wideWidth], maxZ[wideWidth];
+        int children[wideWidth];    // >= 0: wide node, < 0: ~index of the leaf in nodes
+        int nChildren;
+    };
+
+    enum class SplitMethod {
+        Middle, // split at the spatial middle of the longest axis
+        SAH     // binned Surface Area Heuristic
+    };
+
+    // wide: rays are traced through the binary tree collapsed into WideNodes
+    // watertight: triangles are tested with the watertight test instead of Möller–Trumbore
+    BVH(const std::vector<Model*>& models, int minSplit=100,
+        SplitMethod splitMethod=SplitMethod::Middle, bool wide=false,
+        bool watertight=false): models(models),
+                                minSplit(minSplit),
+                                splitMethod(splitMethod),
+                                wide(wide),
+                                watertight(watertight),
+                                numberOfNodes(1),
+                                numberOfLeaves(0),
+                                depth(0),
+                                sahCost(0.f),
+                                buildSahCost(0.f) {
         std::cout << "BVH.h" << std::endl;
         std::cout << "      Building BVH.. ";
 
         if (models.size() == 0)
             throw std::length_error("Length of models vector is 0.");
  
-        for (std::size_t i = 0; i < models.size(); i++) {
-            std::vector<int> currentIndices;
-            for (std::size_t j = 0; j < models[i]->getIndices().size(); j++) {
-                currentIndices.push_back(j);
-            }
-            root->indices[i] = currentIndices;
-            root->size += currentIndices.size();
+        computeTriangleBounds();
+        Node* root = new Node();
+        root->size = buildOrder.size();
+        root->aabb = computeOverallAABB(models);
+
+        // The subtrees are built by tasks, the end of the parallel region waits for all of them
+        #pragma omp parallel
+        #pragma omp single
+        {
+            if (splitMethod == SplitMethod::SAH)
+                recursiveBuildSAH(root, 0);
+            else
+                recursiveBuild(root, 0);
         }
 
-        root->aabb = computeOverallAABB(models);
-        recursiveBuild(root);
+        // Compact the tree into the linear layout used for traversal
+        nodes.resize(numberOfNodes);
+        primitives.reserve(root->size);
+        int offset = 0;
+        depth = flatten(root, offset, 0);
+        padPrimitives();
+        assignLeafIds();
+        delete root;
+        std::vector<AABB>().swap(triangleBounds);
+        std::vector<Vec3<float>>().swap(centroids);
+        std::vector<int>().swap(buildOrder);
+        buildTrianglePackets();
+
+        sahCost = computeSAHCost(0);
+        buildSahCost = sahCost;
+        if (wide)
+            collapse(0);
         std::cout << "Done" << std::endl;
         printInfos();
     }
 
-    ~BVH() { delete root; }
+    // Closest hit within the interval of the ray, whose tMax shrinks to the hit: visit
+    // the nearer child first, test the triangles of a leaf as soon as it is reached
+    // and skip every node that starts behind the closest hit so far
+    bool intersect(const Ray& ray, Ray::Hit& hit) const {
+        bool foundHit = wide ? intersectWide(ray, hit) : intersectSubtree(ray, 0, hit);
+        if (foundHit)
+            Ray::computeInterpolatedNormal(hit);
 
-    std::vector<Node*> recursiveIntersect(Node* node, const Ray& ray) const {
-        std::vector<Node*> nodesIntersected;
-        if (!ray.intersectAABB(node->aabb))
-            return nodesIntersected;
+        return foundHit;
+    }
 
-        if (!node->left && !node->right) {
-            nodesIntersected.push_back(node);
-            return nodesIntersected;
+    // Closest hit of each ray of the packet, found[k] tells whether hits[k] is valid.
+    // The packet is traced as a whole while its rays agree on the traversal order,
+    // a ray left alone in a subtree finishes it on its own
+    void intersect(RayPacket& packet, Ray::Hit* hits, bool* found) const {
+        int count = packet.getCount();
+        for (int k = 0; k < count; k++)
+            found[k] = false;
+
+        // The watertight test works in the space of each ray
+        if (!packet.isCoherent() || watertight) {
+            for (int k = 0; k < count; k++)
+                found[k] = intersect(packet.getRay(k), hits[k]);
+            return;
+        }
+
+        alignas(32) float t[RayPacket::size], b1[RayPacket::size], b2[RayPacket::size];
+        int stack[maxStackSize];
+        int stackSize = 0;
+        int nodeIndex = 0;
+        while (true) {
+            const LinearNode& node = nodes[nodeIndex];
+            int active = packet.intersectAABB(node.aabb);
+            if (active && !node.isLeaf() && (active & (active - 1)) == 0) {
+                // Single ray left: no point in testing the other lanes
+                int k = lowestLane(active);
+                const Ray& ray = packet.getRay(k);
+                ray.setTMax(packet.tMax[k]);
+                if (intersectSubtree(ray, nodeIndex, hits[k]))
+                    found[k] = true;
+                packet.tMax[k] = ray.getTMax();
+            } else if (active && !node.isLeaf()) {
+                if (packet.dirIsNeg[node.axis]) {
+                    stack[stackSize++] = nodeIndex + 1;
+                    nodeIndex = node.secondChildOffset;
+                } else {
+                    stack[stackSize++] = node.secondChildOffset;
+                    nodeIndex = nodeIndex + 1;
+                }
+                continue;
+            } else if (active) {
+                for (int i = node.primitivesOffset; i < node.primitivesOffset + node.nPrimitives; i++) {
+                    const Primitive& primitive = primitives[i];
+                    const Model& model = *models[primitive.model];
+                    const TrianglePacket& tp = trianglePackets[i / packetSize];
+                    int j = i % packetSize;
+
+                    int lanes = packet.intersectTriangle(Vec3<float>(tp.v0x[j], tp.v0y[j], tp.v0z[j]),
+                                                         Vec3<float>(tp.e1x[j], tp.e1y[j], tp.e1z[j]),
+                                                         Vec3<float>(tp.e2x[j], tp.e2y[j], tp.e2z[j]),
+                                                         t, b1, b2) & active;
+                    for (; lanes; lanes &= lanes - 1) {
+                        int k = lowestLane(lanes);
+                        Ray::Hit& hit = hits[k];
+                        hit.index = primitive.index;
+                        hit.distance = t[k];
+                        hit.b1 = b1[k];
+                        hit.b2 = b2[k];
+                        hit.b0 = 1.f - b1[k] - b2[k];
+                        hit.faceNormal = model.getFaceNormals()[primitive.index];
+                        hit.m = &model;
+                        hit.instance = nullptr;
+                        hit.info = &node;
+                        packet.tMax[k] = t[k];
+                        found[k] = true;
+                    }
+                }
+            }
+
+            if (stackSize == 0)
+                break;
+            nodeIndex = stack[--stackSize];
         }
 
-        std::vector<Node*> leftIntersected, rightIntersected;
-        if (node->left)
-            leftIntersected = recursiveIntersect(node->left, ray);
-        if (node->right)
-            rightIntersected = recursiveIntersect(node->right, ray);
+        for (int k = 0; k < count; k++)
+            if (found[k])
+                Ray::computeInterpolatedNormal(hits[k]);
+    }
+
+    // Any hit within [epsilon, tMax] of the ray: the traversal stops at the first occluder
+    bool occluded(const Ray& ray) const {
+        if (wide)
+            return occludedWide(ray);
+
+        int stack[maxStackSize];
+        int stackSize = 0;
+        int nodeIndex = 0;
+        while (true) {
+            const LinearNode& node = nodes[nodeIndex];
+            float tEntry;
+            if (ray.intersectAABB(node.aabb, tEntry)) {
+                if (!node.isLeaf()) {
+                    stack[stackSize++] = node.secondChildOffset;
+                    nodeIndex = nodeIndex + 1;
+                    continue;
+                }
 
-        // Merge the vectors of intersected nodes
-        nodesIntersected.reserve(leftIntersected.size() + rightIntersected.size());
-        nodesIntersected.insert(nodesIntersected.end(), leftIntersected.begin(), leftIntersected.end());
-        nodesIntersected.insert(nodesIntersected.end(), rightIntersected.begin(), rightIntersected.end());
+                if (occludedLeaf(ray, node))
+                    return true;
+            }
 
-        return nodesIntersected;
+            if (stackSize == 0)
+                return false;
+            nodeIndex = stack[--stackSize];
+        }
     }
 
-    bool intersect(const Ray& ray, std::map<int, std::vector<int>>& indices) const {
-        std::vector<Node*> nodesIntersected = recursiveIntersect(root, ray);
-        if (nodesIntersected.size() == 0)
-            return false;
+    // Bounds of the nodes recomputed bottom-up from the current vertices of the models,
+    // in O(n). The tree and its leaves are kept, so its quality degrades as the models
+    // move: returns the SAH cost of the refitted tree.
+    float refit() {
+        // Children follow their parent in nodes, walking backwards visits them first
+        for (int i = (int) nodes.size() - 1; i >= 0; i--) {
+            LinearNode& node = nodes[i];
+            node.aabb = AABB();
+            if (!node.isLeaf()) {
+                node.aabb.update(nodes[i + 1].aabb);
+                node.aabb.update(nodes[node.secondChildOffset].aabb);
+                continue;
+            }
 
-        // Merge the indices of each intersected node
-        for (Node* node: nodesIntersected)
-            for (auto& item: node->indices)
-                indices[item.first].insert(indices[item.first].end(), item.second.begin(), item.second.end());
+            for (int j = node.primitivesOffset; j < node.primitivesOffset + node.nPrimitives; j++) {
+                const Primitive& primitive = primitives[j];
+                const auto& vertices = models[primitive.model]->getVertices();
+                const Vec3<int>& triangle = models[primitive.model]->getIndices()[primitive.index];
+                node.aabb.update(vertices[triangle[0]]);
+                node.aabb.update(vertices[triangle[1]]);
+                node.aabb.update(vertices[triangle[2]]);
+            }
+        }
 
-        return true;
+        buildTrianglePackets();
+        if (wide) {
+            wideNodes.clear();
+            collapse(0);
+        }
+        sahCost = computeSAHCost(0);
+        return sahCost;
     }
 
-    bool intersect(const Ray& ray, std::vector<Node*>& nodesIntersected) const {
-        nodesIntersected = recursiveIntersect(root, ray);
-        if (nodesIntersected.size() == 0)
-            return false;
+    float getSAHCost() const { return sahCost; }
+    // SAH cost when the tree was built, before any refit
+    float getBuildSAHCost() const { return buildSahCost; }
 
-        return true;
+    const std::vector<LinearNode>& getNodes() const { return nodes; }
+    int getNumberOfLeaves() const { return numberOfLeaves; }
+    // Leaves are numbered from 0 in depth-first order, -1 for an interior node
+    int getLeafId(const LinearNode* node) const { return leafIds[node - nodes.data()]; }
+
+    // Key of a leaf that survives rebuilds of the BVH: the hash of its bounds rounded to
+    // 1/1024 and of the vertices of its triangles. The leaves of models left untouched
+    // keep their key when others change, a leaf whose triangles changed gets a new one.
+    uint64_t leafKey(const LinearNode& node) const {
+        uint64_t hash = hashValue(node.nPrimitives);
+        for (int i = 0; i < 2; i++)
+            for (int axis = 0; axis < 3; axis++)
+                hash = hashValue((int32_t) std::lround(node.aabb[i][axis] * 1024.f), hash);
+        for (int i = node.primitivesOffset; i < node.primitivesOffset + node.nPrimitives; i++) {
+            const Model& model = *models[primitives[i].model];
+            const Vec3<int>& triangle = model.getIndices()[primitives[i].index];
+            for (int k = 0; k < 3; k++)
+                hash = hashValue(model.getVertices()[triangle[k]], hash);
+        }
+        return hash;
     }
+    const std::vector<Primitive>& getPrimitives() const { return primitives; }
 
     void printInfos() const {
         std::cout << "      # of models:        " << models.size() << std::endl;
-        std::cout << "      min. size to split: " << minSplit << std::endl;
-        std::cout << "      number of nodes:    " << numberOfNodes << std::endl;
+        std::cout << "      split method:       " << (splitMethod == SplitMethod::SAH ? "SAH" : "Middle") << std::endl;
+        if (splitMethod == SplitMethod::Middle)
+            std::cout << "      min. size to split: " << minSplit << std::endl;
+        std::cout << "      number of nodes:    " << numberOfNodes << " (" << numberOfLeaves << " leaves)" << std::endl;
+        std::cout << "      depth:              " << depth << std::endl;
+        std::cout << "      SAH cost:           " << sahCost;
+        if (sahCost != buildSahCost)
+            std::cout << " (" << buildSahCost << " when built)";
+        std::cout << std::endl;
+        if (wide)
+            std::cout << "      wide nodes:         " << wideNodes.size() << " (BVH" << wideWidth << ")" << std::endl;
+        std::cout << "      memory (KB):        " << (nodes.size() * sizeof(LinearNode)
+                                                      + wideNodes.size() * sizeof(WideNode)
+                                                      + primitives.size() * sizeof(Primitive)
+                                                      + leafIds.size() * sizeof(int)) / 1024 << std::endl;
+        std::size_t packets = watertight ? watertightPackets.size() : trianglePackets.size();
+        std::cout << "      triangles (KB):     " << (trianglePackets.size() * sizeof(TrianglePacket)
+                                                      + watertightPackets.size() * sizeof(WatertightPacket)) / 1024
+                  << " (" << packets * packetSize - countPrimitives(0) << " padding"
+                  << (watertight ? ", watertight)" : ")") << std::endl;
         // std::cout << "BVH Tree:" << std::endl;
-        // printTreePostorder(root);
+        // printTreePostorder(0);
     }
 
-    void printTreePostorder(Node* node, int indent=0) const {
-        if(node->left)
-            printTreePostorder(node->left, indent+10);
+    void printTreePostorder(int nodeIndex, int indent=0) const {
+        const LinearNode& node = nodes[nodeIndex];
+        if (!node.isLeaf())
+            printTreePostorder(nodeIndex + 1, indent+10);
 
         if (indent)
             std::cout << std::setw(indent) << ' ';
-        std::cout << "#triangles: " << node->size << std::endl;
+        std::cout << "#triangles: " << countPrimitives(nodeIndex) << std::endl;
 
-        if(node->right)
-            printTreePostorder(node->right, indent+10);
+        if (!node.isLeaf())
+            printTreePostorder(node.secondChildOffset, indent+10);
     }
 
 private:
+    // Closest hit in the subtree rooted at nodeIndex, within the interval of the
+    // ray. The interpolated normal is left to the caller.
+    bool intersectSubtree(const Ray& ray, int nodeIndex, Ray::Hit& hit) const {
+        float tEntry;
+        if (!ray.intersectAABB(nodes[nodeIndex].aabb, tEntry))
+            return false;
+
+        struct Entry {
+            int node;
+            float tEntry;
+        };
+        Entry stack[maxStackSize];
+        int stackSize = 0;
+
+        bool foundHit = false;
+        while (true) {
+            const LinearNode& node = nodes[nodeIndex];
+            if (node.isLeaf()) {
+                if (intersectLeaf(ray, node, hit))
+                    foundHit = true;
+            } else {
+                // Both children are tested, the nearer one is visited first
+                int first = nodeIndex + 1, second = node.secondChildOffset;
+                float tFirst, tSecond;
+                bool hitFirst = ray.intersectAABB(nodes[first].aabb, tFirst);
+                bool hitSecond = ray.intersectAABB(nodes[second].aabb, tSecond);
+                if (hitFirst && hitSecond) {
+                    if (tSecond < tFirst) {
+                        std::swap(first, second);
+                        std::swap(tFirst, tSecond);
+                    }
+                    stack[stackSize++] = {second, tSecond};
+                    nodeIndex = first;
+                    continue;
+                }
+                if (hitFirst || hitSecond) {
+                    nodeIndex = hitFirst ? first : second;
+                    continue;
+                }
+            }
+
+            // Skip the nodes that start behind the closest hit found since they were pushed
+            while (stackSize > 0 && stack[stackSize - 1].tEntry > ray.getTMax())
+                stackSize--;
+            if (stackSize == 0)
+                break;
+            nodeIndex = stack[--stackSize].node;
+        }
+
+        return foundHit;
+    }
+
+    // Triangles of the packet hit within [tMin, tMax], with their distances and
+    // barycentric coordinates: Möller–Trumbore on packetSize triangles at once
+    static int intersectTriangles(const TrianglePacket& tp, const simd::vvec3& origin, const simd::vvec3& direction,
+                                  float tMin, float tMax, float epsilon, float* t, float* b1, float* b2) {
+        using namespace simd;
+        vvec3 edge1(vfloat::load(tp.e1x), vfloat::load(tp.e1y), vfloat::load(tp.e1z));
+        vvec3 edge2(vfloat::load(tp.e2x), vfloat::load(tp.e2y), vfloat::load(tp.e2z));
+        vvec3 v0(vfloat::load(tp.v0x), vfloat::load(tp.v0y), vfloat::load(tp.v0z));
+
+        vvec3 pvec = cross(direction, edge2);
+        vfloat det = dot(edge1, pvec);
+        vfloat invDet = vfloat(1.f) / det;
+        vvec3 tvec = origin - v0;
+        vfloat u = dot(tvec, pvec) * invDet;
+        vvec3 qvec = cross(tvec, edge1);
+        vfloat v = dot(direction, qvec) * invDet;
+        vfloat distance = dot(edge2, qvec) * invDet;
+
+        vmask mask = (abs(det) >= vfloat(epsilon))
+                     & (u >= vfloat(0.f)) & (u <= vfloat(1.f))
+                     & (v >= vfloat(0.f)) & (u + v <= vfloat(1.f))
+                     & (distance >= vfloat(tMin)) & (distance <= vfloat(tMax));
+        int lanes = mask.bits();
+        if (lanes) {
+            distance.store(t);
+            u.store(b1);
+            v.store(b2);
+        }
+        return lanes;
+    }
+
+    // Watertight test of Woop et al. on packetSize triangles at once: the vertices are
+    // moved to the space where the ray is the z axis, and the hit is decided by the signs
+    // of the 2D edge functions, so that a ray can't slip through a shared edge
+    // source: Woop, Benthin and Wald, Watertight Ray/Triangle Intersection, JCGT 2013
+    static int intersectTrianglesWatertight(const WatertightPacket& tp, const Ray& ray,
+                                            float tMin, float tMax, float* t, float* b1, float* b2) {
+        using namespace simd;
+        int kx = ray.getKx(), ky = ray.getKy(), kz = ray.getKz();
+        const Vec3<float>& o = ray.getOrigin();
+        const Vec3<float>& shear = ray.getShear();
+        vfloat sx(shear[0]), sy(shear[1]), sz(shear[2]);
+
+        vfloat az = vfloat::load(tp.v0[kz]) - vfloat(o[kz]);
+        vfloat bz = vfloat::load(tp.v1[kz]) - vfloat(o[kz]);
+        vfloat cz = vfloat::load(tp.v2[kz]) - vfloat(o[kz]);
+        vfloat ax = vfloat::load(tp.v0[kx]) - vfloat(o[kx]) - sx * az;
+        vfloat ay = vfloat::load(tp.v0[ky]) - vfloat(o[ky]) - sy * az;
+        vfloat bx = vfloat::load(tp.v1[kx]) - vfloat(o[kx]) - sx * bz;
+        vfloat by = vfloat::load(tp.v1[ky]) - vfloat(o[ky]) - sy * bz;
+        vfloat cx = vfloat::load(tp.v2[kx]) - vfloat(o[kx]) - sx * cz;
+        vfloat cy = vfloat::load(tp.v2[ky]) - vfloat(o[ky]) - sy * cz;
+
+        vfloat u = cx * by - cy * bx;
+        vfloat v = ax * cy - ay * cx;
+        vfloat w = bx * ay - by * ax;
+
+        // A ray through an edge or a vertex gives an edge function of 0 in single
+        // precision, the exact sign is recovered in double precision
+        int onEdge = ((u == vfloat(0.f)) | (v == vfloat(0.f)) | (w == vfloat(0.f))).bits();
+        if (onEdge) {
+            alignas(32) float e[9][packetSize];
+            ax.store(e[0]); ay.store(e[1]); bx.store(e[2]);
+            by.store(e[3]); cx.store(e[4]); cy.store(e[5]);
+            u.store(e[6]); v.store(e[7]); w.store(e[8]);
+            for (; onEdge; onEdge &= onEdge - 1) {
+                int k = lowestLane(onEdge);
+                e[6][k] = (float) ((double) e[4][k] * e[3][k] - (double) e[5][k] * e[2][k]);
+                e[7][k] = (float) ((double) e[0][k] * e[5][k] - (double) e[1][k] * e[4][k]);
+                e[8][k] = (float) ((double) e[2][k] * e[1][k] - (double) e[3][k] * e[0][k]);
+            }
+            u = vfloat::load(e[6]);
+            v = vfloat::load(e[7]);
+            w = vfloat::load(e[8]);
+        }
+
+        vmask outside = ((u < vfloat(0.f)) | (v < vfloat(0.f)) | (w < vfloat(0.f)))
+                        & ((u > vfloat(0.f)) | (v > vfloat(0.f)) | (w > vfloat(0.f)));
+        vfloat det = u + v + w;
+        vfloat invDet = vfloat(1.f) / det;
+        vfloat distance = (u * (sz * az) + v * (sz * bz) + w * (sz * cz)) * invDet;
+
+        vmask mask = andnot(outside | (det == vfloat(0.f)),
+                            (distance >= vfloat(tMin)) & (distance <= vfloat(tMax)));
+        int lanes = mask.bits();
+        if (lanes) {
+            distance.store(t);
+            (v * invDet).store(b1);
+            (w * invDet).store(b2);
+        }
+        return lanes;
+    }
+
+    // Triangles of packet p hit within [tMin, tMax], with the test chosen at build time
+    int intersectPacket(int p, const Ray& ray, const simd::vvec3& origin, const simd::vvec3& direction,
+                        float tMin, float tMax, float* t, float* b1, float* b2) const {
+        if (watertight)
+            return intersectTrianglesWatertight(watertightPackets[p], ray, tMin, tMax, t, b1, b2);
+
+        return intersectTriangles(trianglePackets[p], origin, direction, tMin, tMax, ray.getDeterminantEpsilon(), t, b1, b2);
+    }
+
+    // Closest triangle of the leaf within the interval of the ray, tMax shrinks to the hit
+    bool intersectLeaf(const Ray& ray, const LinearNode& node, Ray::Hit& hit) const {
+        const Vec3<float>& o = ray.getOrigin();
+        const Vec3<float>& d = ray.getDirection();
+        simd::vvec3 origin(o[0], o[1], o[2]);
+        simd::vvec3 direction(d[0], d[1], d[2]);
+
+        alignas(32) float t[packetSize], b1[packetSize], b2[packetSize];
+        float closest = ray.getTMax();
+        int closestPrimitive = -1;
+        int end = node.primitivesOffset + node.nPrimitives;
+        for (int i = node.primitivesOffset; i < end; i += packetSize) {
+            int lanes = intersectPacket(i / packetSize, ray, origin, direction, ray.getTMin(), closest, t, b1, b2);
+            for (; lanes; lanes &= lanes - 1) {
+                int k = lowestLane(lanes);
+                if (t[k] >= closest)
+                    continue;
+
+                closest = t[k];
+                closestPrimitive = i + k;
+                hit.b1 = b1[k];
+                hit.b2 = b2[k];
+            }
+        }
+
+        if (closestPrimitive < 0)
+            return false;
+
+        ray.setTMax(closest);
+        const Primitive& primitive = primitives[closestPrimitive];
+        hit.index = primitive.index;
+        hit.distance = closest;
+        hit.b0 = 1.f - hit.b1 - hit.b2;
+        hit.faceNormal = models[primitive.model]->getFaceNormals()[primitive.index];
+        hit.m = models[primitive.model];
+        hit.instance = nullptr;
+        hit.l = nullptr;
+        hit.info = &node;
+        return true;
+    }
+
+    bool occludedLeaf(const Ray& ray, const LinearNode& node) const {
+        const Vec3<float>& o = ray.getOrigin();
+        const Vec3<float>& d = ray.getDirection();
+        simd::vvec3 origin(o[0], o[1], o[2]);
+        simd::vvec3 direction(d[0], d[1], d[2]);
+
+        alignas(32) float t[packetSize], b1[packetSize], b2[packetSize];
+        int end = node.primitivesOffset + node.nPrimitives;
+        for (int i = node.primitivesOffset; i < end; i += packetSize) {
+            if (intersectPacket(i / packetSize, ray, origin, direction,
+                                std::max(ray.getTMin(), ray.getEpsilon()), ray.getTMax(), t, b1, b2))
+                return true;
+        }
+
+        return false;
+    }
+
+    // Entry distance of the ray in each child of the wide node, returns the
+    // children whose box overlaps [tMin, tMax]
+    // Same test as Ray::intersectAABB on each child: the sign of the direction picks the
+    // near and far planes, and a NaN plane is ignored. SIMD min and max return their
+    // second operand when one is NaN, the interval therefore comes second.
+    int intersectChildren(const WideNode& node, const simd::vvec3& origin, const simd::vvec3& invDirection,
+                          const Ray& ray, float* tEntry) const {
+        using namespace simd;
+        int sx = ray.getSign(0), sy = ray.getSign(1), sz = ray.getSign(2);
+        vfloat x0 = (vfloat::load(sx ? node.maxX : node.minX) - origin.x) * invDirection.x;
+        vfloat x1 = (vfloat::load(sx ? node.minX : node.maxX) - origin.x) * invDirection.x;
+        vfloat y0 = (vfloat::load(sy ? node.maxY : node.minY) - origin.y) * invDirection.y;
+        vfloat y1 = (vfloat::load(sy ? node.minY : node.maxY) - origin.y) * invDirection.y;
+        vfloat z0 = (vfloat::load(sz ? node.maxZ : node.minZ) - origin.z) * invDirection.z;
+        vfloat z1 = (vfloat::load(sz ? node.minZ : node.maxZ) - origin.z) * invDirection.z;
+
+        vfloat entry = max(z0, max(y0, max(x0, vfloat(ray.getTMin()))));
+        vfloat exit = min(z1, min(y1, min(x1, vfloat(ray.getTMax()))));
+        entry.store(tEntry);
+        return (entry <= exit).bits() & ((1 << node.nChildren) - 1);
+    }
+
+    // Closest hit through the wide nodes, the children are visited nearest first
+    bool intersectWide(const Ray& ray, Ray::Hit& hit) const {
+        const Vec3<float>& o = ray.getOrigin();
+        const Vec3<float>& inv = ray.getInvDirection();
+        simd::vvec3 origin(o[0], o[1], o[2]);
+        simd::vvec3 invDirection(inv[0], inv[1], inv[2]);
+
+        struct Entry {
+            int node;
+            float tEntry;
+        };
+        Entry stack[wideStackSize];
+        int stackSize = 0;
+        stack[stackSize++] = {0, 0.f};
+
+        bool foundHit = false;
+        alignas(32) float tEntry[wideWidth];
+        while (stackSize > 0) {
+            Entry entry = stack[--stackSize];
+            if (entry.tEntry > ray.getTMax())
+                continue;
+
+            if (entry.node < 0) {
+                if (intersectLeaf(ray, nodes[~entry.node], hit))
+                    foundHit = true;
+                continue;
+            }
+
+            const WideNode& node = wideNodes[entry.node];
+            int lanes = intersectChildren(node, origin, invDirection, ray, tEntry);
+
+            // Push the farthest children first, insertion sorted by entry distance
+            int first = stackSize;
+            for (; lanes; lanes &= lanes - 1) {
+                int k = lowestLane(lanes);
+                int i = stackSize++;
+                while (i > first && stack[i - 1].tEntry < tEntry[k]) {
+                    stack[i] = stack[i - 1];
+                    i--;
+                }
+                stack[i] = {node.children[k], tEntry[k]};
+            }
+        }
+
+        return foundHit;
+    }
+
+    bool occludedWide(const Ray& ray) const {
+        const Vec3<float>& o = ray.getOrigin();
+        const Vec3<float>& inv = ray.getInvDirection();
+        simd::vvec3 origin(o[0], o[1], o[2]);
+        simd::vvec3 invDirection(inv[0], inv[1], inv[2]);
+
+        int stack[wideStackSize];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+
+        alignas(32) float tEntry[wideWidth];
+        while (stackSize > 0) {
+            int nodeIndex = stack[--stackSize];
+            if (nodeIndex < 0) {
+                if (occludedLeaf(ray, nodes[~nodeIndex]))
+                    return true;
+                continue;
+            }
+
+            const WideNode& node = wideNodes[nodeIndex];
+            int lanes = intersectChildren(node, origin, invDirection, ray, tEntry);
+            for (; lanes; lanes &= lanes - 1)
+                stack[stackSize++] = node.children[lowestLane(lanes)];
+        }
+
+        return false;
+    }
+
+    // Collapse the binary subtree into wide nodes: the child with the largest
+    // surface area is replaced by its own children until the node is full.
+    // Leaves are kept as is, the hits still point to the binary leaves.
+    int collapse(int nodeIndex) {
+        std::vector<int> children;
+        if (nodes[nodeIndex].isLeaf())
+            children.push_back(nodeIndex);
+        else
+            children = {nodeIndex + 1, nodes[nodeIndex].secondChildOffset};
+
+        while ((int) children.size() < wideWidth) {
+            int best = -1;
+            float bestArea = -1.f;
+            for (std::size_t i = 0; i < children.size(); i++) {
+                const LinearNode& child = nodes[children[i]];
+                if (!child.isLeaf() && child.aabb.surfaceArea() > bestArea) {
+                    best = i;
+                    bestArea = child.aabb.surfaceArea();
+                }
+            }
+            if (best < 0)
+                break;
+
+            int opened = children[best];
+            children[best] = opened + 1;
+            children.push_back(nodes[opened].secondChildOffset);
+        }
+
+        int wideIndex = wideNodes.size();
+        wideNodes.emplace_back();
+        WideNode& node = wideNodes[wideIndex];
+        node.nChildren = children.size();
+        for (int k = 0; k < wideWidth; k++) {
+            // Unused slots are masked out by nChildren
+            const AABB& aabb = nodes[children[std::min(k, node.nChildren - 1)]].aabb;
+            node.minX[k] = aabb.getMinBound()[0];
+            node.minY[k] = aabb.getMinBound()[1];
+            node.minZ[k] = aabb.getMinBound()[2];
+            node.maxX[k] = aabb.getMaxBound()[0];
+            node.maxY[k] = aabb.getMaxBound()[1];
+            node.maxZ[k] = aabb.getMaxBound()[2];
+            node.children[k] = 0;
+        }
+
+        // wideNodes grows while collapsing the children
+        for (int k = 0; k < (int) children.size(); k++) {
+            int child = nodes[children[k]].isLeaf() ? ~children[k] : collapse(children[k]);
+            wideNodes[wideIndex].children[k] = child;
+        }
+
+        return wideIndex;
+    }
+
+    static int lowestLane(int lanes) {
+        int k = 0;
+        while (!(lanes & (1 << k)))
+            k++;
+        return k;
+    }
+
     AABB computeOverallAABB(const std::vector<Model*>& models) {
         AABB aabb;
         for (const auto& m: models)
@@ -130,10 +740,314 @@ private:
         return aabb;
     }
 
-    void recursiveBuild(Node* node) {
-        if (!node || node->size <= minSplit)
+    // Bounds and centroid of every triangle, computed once for the whole build.
+    // Triangles are numbered model after model, from firstTriangle[model].
+    void computeTriangleBounds() {
+        firstTriangle.assign(models.size() + 1, 0);
+        for (std::size_t i = 0; i < models.size(); i++)
+            firstTriangle[i + 1] = firstTriangle[i] + models[i]->getIndices().size();
+
+        int numberOfTriangles = firstTriangle.back();
+        triangleBounds.assign(numberOfTriangles, AABB());
+        centroids.resize(numberOfTriangles);
+        buildOrder.resize(numberOfTriangles);
+        for (std::size_t i = 0; i < models.size(); i++) {
+            const auto& vertices = models[i]->getVertices();
+            const auto& indices = models[i]->getIndices();
+            int first = firstTriangle[i];
+
+            #pragma omp parallel for if(indices.size() > parallelBuildSize)
+            for (std::size_t j = 0; j < indices.size(); j++) {
+                AABB& aabb = triangleBounds[first + j];
+                aabb.update(vertices[indices[j][0]]);
+                aabb.update(vertices[indices[j][1]]);
+                aabb.update(vertices[indices[j][2]]);
+                centroids[first + j] = aabb.getCentroid();
+                buildOrder[first + j] = first + j;
+            }
+        }
+    }
+
+    // Bounds of the triangles buildOrder[begin, end)
+    AABB computeBounds(int begin, int end) const {
+        AABB aabb;
+        for (int i = begin; i < end; i++)
+            aabb.update(triangleBounds[buildOrder[i]]);
+        return aabb;
+    }
+
+    // Children get the two parts of the triangles of the node, the first leftSize to the left
+    void createChildren(Node* node, int leftSize, int axis, const AABB& leftBounds, const AABB& rightBounds) {
+        node->left = new Node();
+        node->left->begin = node->begin;
+        node->left->size = leftSize;
+        node->left->aabb = leftBounds;
+        node->right = new Node();
+        node->right->begin = node->begin + leftSize;
+        node->right->size = node->size - leftSize;
+        node->right->aabb = rightBounds;
+        node->axis = axis;
+        #pragma omp atomic
+        numberOfNodes += 2;
+    }
+
+    // Returns the depth of the subtree
+    int flatten(const Node* node, int& offset, int depth) {
+        int nodeIndex = offset++;
+        LinearNode& linearNode = nodes[nodeIndex];
+        linearNode.aabb = node->aabb;
+
+        if (!node->left && !node->right) {
+            padPrimitives();
+            linearNode.primitivesOffset = primitives.size();
+            linearNode.nPrimitives = node->size;
+            linearNode.axis = 0;
+            linearNode.leaf = 1;
+            // Partitioning shuffled the triangles, leaves list them model after model in their order
+            auto begin = buildOrder.begin() + node->begin;
+            std::sort(begin, begin + node->size);
+            int model = 0;
+            for (auto it = begin; it != begin + node->size; ++it) {
+                while (*it >= firstTriangle[model + 1])
+                    model++;
+                primitives.push_back({model, *it - firstTriangle[model]});
+            }
+            return depth;
+        }
+
+        linearNode.nPrimitives = 0;
+        linearNode.axis = node->axis;
+        linearNode.leaf = 0;
+        int leftDepth = flatten(node->left, offset, depth + 1);
+        // nodes is preallocated, linearNode is still valid
+        linearNode.secondChildOffset = offset;
+        int rightDepth = flatten(node->right, offset, depth + 1);
+
+        return std::max(leftDepth, rightDepth);
+    }
+
+    // Align the next leaf on a triangle packet, padding entries reference no triangle
+    void padPrimitives() {
+        while (primitives.size() % packetSize)
+            primitives.push_back({-1, -1});
+    }
+
+    void buildTrianglePackets() {
+        if (watertight) {
+            buildWatertightPackets();
+            return;
+        }
+
+        // Degenerate triangles never pass the determinant test
+        trianglePackets.assign(primitives.size() / packetSize, TrianglePacket());
+        for (std::size_t i = 0; i < primitives.size(); i++) {
+            const Primitive& primitive = primitives[i];
+            if (primitive.model < 0)
+                continue;
+
+            const auto& vertices = models[primitive.model]->getVertices();
+            const Vec3<int>& triangle = models[primitive.model]->getIndices()[primitive.index];
+            Vec3<float> v0 = vertices[triangle[0]];
+            Vec3<float> e1 = vertices[triangle[1]] - v0;
+            Vec3<float> e2 = vertices[triangle[2]] - v0;
+
+            TrianglePacket& tp = trianglePackets[i / packetSize];
+            int k = i % packetSize;
+            tp.v0x[k] = v0[0]; tp.v0y[k] = v0[1]; tp.v0z[k] = v0[2];
+            tp.e1x[k] = e1[0]; tp.e1y[k] = e1[1]; tp.e1z[k] = e1[2];
+            tp.e2x[k] = e2[0]; tp.e2y[k] = e2[1]; tp.e2z[k] = e2[2];
+        }
+    }
+
+    void buildWatertightPackets() {
+        WatertightPacket padding;
+        std::fill(&padding.v0[0][0], &padding.v0[0][0] + 9 * packetSize, std::numeric_limits<float>::quiet_NaN());
+        watertightPackets.assign(primitives.size() / packetSize, padding);
+        for (std::size_t i = 0; i < primitives.size(); i++) {
+            const Primitive& primitive = primitives[i];
+            if (primitive.model < 0)
+                continue;
+
+            const auto& vertices = models[primitive.model]->getVertices();
+            const Vec3<int>& triangle = models[primitive.model]->getIndices()[primitive.index];
+            WatertightPacket& tp = watertightPackets[i / packetSize];
+            int k = i % packetSize;
+            for (int axis = 0; axis < 3; axis++) {
+                tp.v0[axis][k] = vertices[triangle[0]][axis];
+                tp.v1[axis][k] = vertices[triangle[1]][axis];
+                tp.v2[axis][k] = vertices[triangle[2]][axis];
+            }
+        }
+    }
+
+    void assignLeafIds() {
+        leafIds.assign(nodes.size(), -1);
+        for (std::size_t i = 0; i < nodes.size(); i++)
+            if (nodes[i].isLeaf())
+                leafIds[i] = numberOfLeaves++;
+    }
+
+    int countPrimitives(int nodeIndex) const {
+        const LinearNode& node = nodes[nodeIndex];
+        if (node.isLeaf())
+            return node.nPrimitives;
+
+        return countPrimitives(nodeIndex + 1) + countPrimitives(node.secondChildOffset);
+    }
+
+    // Expected cost of a ray traversing the subtree, relative to the root surface area
+    float computeSAHCost(int nodeIndex) const {
+        const LinearNode& node = nodes[nodeIndex];
+        if (node.isLeaf())
+            return sahIntersectionCost * node.nPrimitives;
+
+        float area = node.aabb.surfaceArea();
+        if (area <= 0.f)
+            return sahTraversalCost;
+
+        const LinearNode& left = nodes[nodeIndex + 1];
+        const LinearNode& right = nodes[node.secondChildOffset];
+        return sahTraversalCost
+               + (left.aabb.surfaceArea() * computeSAHCost(nodeIndex + 1)
+                  + right.aabb.surfaceArea() * computeSAHCost(node.secondChildOffset)) / area;
+    }
+
+    void recursiveBuildSAH(Node* node, int depth) {
+        if (!node || node->size <= 1)
+            return;
+
+        // Past the depth limit the triangles are split by count, down to small leaves
+        if (depth >= maxSplitDepth) {
+            if (node->size > countSplitLeafSize)
+                splitByCount(node);
+        } else if (!splitSAH(node)) {
+            return;
+        }
+        if (!node->left)
+            return;
+
+        #pragma omp task if(node->left->size > parallelBuildSize)
+        recursiveBuildSAH(node->left, depth + 1);
+        recursiveBuildSAH(node->right, depth + 1);
+    }
+
+    // Splits the node at the bin boundary of lowest SAH cost, returns false when
+    // the node stays a leaf
+    bool splitSAH(Node* node) {
+        struct Bin {
+            Bin(): count(0) {}
+            AABB aabb;
+            int count;
+        };
+
+        // Bin the triangles by their centroid
+        int begin = node->begin;
+        int end = node->begin + node->size;
+        AABB centroidBounds;
+        for (int i = begin; i < end; i++)
+            centroidBounds.update(centroids[buildOrder[i]]);
+
+        const Vec3<float>& cMin = centroidBounds.getMinBound();
+        Vec3<float> extent = centroidBounds.getMaxBound() - cMin;
+
+        float bestCost = std::numeric_limits<float>::max();
+        int bestAxis = -1;
+        int bestBin = -1;
+        int bestLeftSize = 0;
+        AABB bestLeftBounds, bestRightBounds;
+        for (int axis = 0; axis < 3; axis++) {
+            if (extent[axis] <= 0.f)
+                continue;
+
+            Bin bins[sahBins];
+            for (int i = begin; i < end; i++) {
+                int triangle = buildOrder[i];
+                int b = binIndex(centroids[triangle][axis], cMin[axis], extent[axis]);
+                bins[b].count++;
+                bins[b].aabb.update(triangleBounds[triangle]);
+            }
+
+            // Sweep from the right to get the cost of each right side, then from the left
+            AABB rightBounds[sahBins];
+            int rightCount[sahBins];
+            AABB aabb;
+            int count = 0;
+            for (int b = sahBins - 1; b > 0; b--) {
+                aabb.update(bins[b].aabb);
+                count += bins[b].count;
+                rightBounds[b] = aabb;
+                rightCount[b] = count;
+            }
+
+            aabb = AABB();
+            count = 0;
+            for (int b = 0; b < sahBins - 1; b++) {
+                aabb.update(bins[b].aabb);
+                count += bins[b].count;
+                if (count == 0 || rightCount[b + 1] == 0)
+                    continue;
+
+                float cost = count * aabb.surfaceArea() + rightCount[b + 1] * rightBounds[b + 1].surfaceArea();
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = b;
+                    bestLeftSize = count;
+                    bestLeftBounds = aabb;
+                    bestRightBounds = rightBounds[b + 1];
+                }
+            }
+        }
+
+        // All centroids are at the same position: a leaf, unless it can't hold them all
+        if (bestAxis < 0) {
+            if (node->size <= maxLeafSize)
+                return false;
+            splitByCount(node);
+            return true;
+        }
+
+        // Stop when splitting is more expensive than intersecting every triangle
+        float area = node->aabb.surfaceArea();
+        float splitCost = sahTraversalCost + sahIntersectionCost * bestCost / area;
+        float leafCost = sahIntersectionCost * node->size;
+        if (area > 0.f && splitCost >= leafCost && node->size <= sahMaxLeafSize)
+            return false;
+
+        // The bins of each side already hold the bounds of its triangles
+        std::partition(buildOrder.begin() + begin, buildOrder.begin() + end, [&](int triangle) {
+            return binIndex(centroids[triangle][bestAxis], cMin[bestAxis], extent[bestAxis]) <= bestBin;
+        });
+        createChildren(node, bestLeftSize, bestAxis, bestLeftBounds, bestRightBounds);
+        return true;
+    }
+
+    static int binIndex(float centroid, float min, float extent) {
+        int b = (int) (sahBins * ((centroid - min) / extent));
+        return std::min(std::max(b, 0), sahBins - 1);
+    }
+
+    void recursiveBuild(Node* node, int depth) {
+        if (!node || node->size <= 1 || (node->size <= minSplit && node->size <= maxLeafSize))
             return;
 
+        // Past the depth limit, or when all the centroids are at the same position
+        // and too many for a leaf, the triangles are split by count
+        if (depth >= maxSplitDepth || !splitMiddle(node)) {
+            if (depth < maxSplitDepth && node->size <= maxLeafSize)
+                return;
+            splitByCount(node);
+        }
+
+        #pragma omp task if(node->left->size > parallelBuildSize)
+        recursiveBuild(node->left, depth + 1);
+        recursiveBuild(node->right, depth + 1);
+    }
+
+    // Splits the node at the spatial middle of its longest axis, or of the next
+    // axes when every centroid falls on the same side. Returns false when the node
+    // stays a leaf.
+    bool splitMiddle(Node* node) {
         Vec3<float> median = (node->aabb.getMinBound() + node->aabb.getMaxBound()) / 2.f;
         Vec3<float> midPoint = node->aabb.getMaxBound() - node->aabb.getMinBound();
 
@@ -143,59 +1057,87 @@ private:
 
         // Split by the pivot
         for (int i = 0; i < 3; i++)
-            if(split(node, median[(axis + i) % 3], (axis + i) % 3)) {
-                numberOfNodes += 2;
-                break;
-            }
+            if (split(node, median[(axis + i) % 3], (axis + i) % 3))
+                return true;
 
-        recursiveBuild(node->left);
-        recursiveBuild(node->right);
+        return false;
     }
 
+    // Partitions the triangles of the node in place by their centroid, the node
+    // stays a leaf when they all fall on the same side
     bool split(Node* node, float pivot, int axis) {
-        Node* left = new Node();
-        Node* right = new Node();
+        auto begin = buildOrder.begin() + node->begin;
+        auto end = begin + node->size;
+        auto middle = std::partition(begin, end, [&](int triangle) {
+            return centroids[triangle][axis] < pivot;
+        });
+        if (middle == begin || middle == end)
+            return false;
 
-        for (std::size_t i = 0; i < models.size(); i++) {
-            const Model& model = *models[i];
-            const auto& triangleIndices = model.getIndices();
-
-            for (int index: node->indices[i]) {
-                const auto& triangle = triangleIndices[index];
-                Vec3<float> v0 = model.getVertices()[triangle[0]];
-                Vec3<float> v1 = model.getVertices()[triangle[1]];
-                Vec3<float> v2 = model.getVertices()[triangle[2]];
-                AABB aabb; aabb.update(v0); aabb.update(v1); aabb.update(v2);
-
-                float centroid = (aabb.getMinBound() + aabb.getMaxBound())[axis] / 2.f;
-
-                if (centroid < pivot) {
-                    left->indices[i].push_back(index);
-                    left->aabb.update(aabb);
-                    left->size++;
-                } else {
-                    right->indices[i].push_back(index);
-                    right->aabb.update(aabb);
-                    right->size++;
-                }
-            }
-        }
+        int leftEnd = middle - buildOrder.begin();
+        createChildren(node, middle - begin, axis, computeBounds(node->begin, leftEnd),
+                       computeBounds(leftEnd, node->begin + node->size));
+        return true;
+    }
 
-        if (left->size == 0 || right->size == 0) {
-            delete left;
-            delete right;
-        } else {
-            node->left = left;
-            node->right = right;
-        }
+    // Halves a node at the median of its centroids along the axis where they spread
+    // the most, whatever their positions: the subtree below it is then at most log2
+    // of its size deep, and no leaf has more triangles than a LinearNode counts
+    void splitByCount(Node* node) {
+        auto begin = buildOrder.begin() + node->begin;
+        auto end = begin + node->size;
+        AABB centroidBounds;
+        for (auto it = begin; it != end; ++it)
+            centroidBounds.update(centroids[*it]);
+        Vec3<float> extent = centroidBounds.getMaxBound() - centroidBounds.getMinBound();
+        int axis = extent[0] > extent[1] ? 0 : 1;
+        axis = extent[axis] > extent[2] ? axis : 2;
 
-        return node->left && node->right;
+        int leftSize = node->size / 2;
+        std::nth_element(begin, begin + leftSize, end, [&](int a, int b) {
+            return centroids[a][axis] < centroids[b][axis];
+        });
+        int leftEnd = node->begin + leftSize;
+        createChildren(node, leftSize, axis, computeBounds(node->begin, leftEnd),
+                       computeBounds(leftEnd, node->begin + node->size));
     }
 
-    Node* root;
-    const std::vector<Model*>& models;
+    // Splits chosen by the heuristics stop at maxSplitDepth, splits by count below it
+    // add at most 31 levels (fewer than 2^31 triangles): the traversal stacks hold
+    // any tree
+    static constexpr int maxSplitDepth = 64;
+    static constexpr int maxStackSize = maxSplitDepth + 32;
+    // A wide node pushes at most wideWidth - 1 more entries than it pops
+    static constexpr int wideStackSize = maxStackSize * (wideWidth - 1) + 1;
+    static constexpr int sahBins = 16;
+    static constexpr int parallelBuildSize = 4096; // triangles below which a subtree is built by its parent task
+    static constexpr int sahMaxLeafSize = 255;
+    static constexpr int countSplitLeafSize = 4;   // SAH leaves past the depth limit
+    static constexpr int maxLeafSize = std::numeric_limits<uint16_t>::max();  // LinearNode::nPrimitives
+    static constexpr float sahTraversalCost = 1.f;
+    static constexpr float sahIntersectionCost = 1.f;
+
+    std::vector<Model*> models;                    // copied, the caller may pass a temporary
+    // While building, indexed by triangle numbered model after model
+    std::vector<int> firstTriangle;                // model index -> number of its first triangle
+    std::vector<AABB> triangleBounds;
+    std::vector<Vec3<float>> centroids;
+    std::vector<int> buildOrder;                   // triangles, partitioned in place among the nodes
+    std::vector<LinearNode> nodes;                 // depth-first, nodes[0] is the root
+    std::vector<Primitive> primitives;             // triangles ordered by leaf, leaves aligned on packets
+    std::vector<TrianglePacket> trianglePackets;   // precomputed triangles, primitives[i] is in packet i / packetSize
+    std::vector<WatertightPacket> watertightPackets; // replaces trianglePackets for the watertight test
+    std::vector<WideNode> wideNodes;               // collapsed tree, wideNodes[0] is the root
+    std::vector<int> leafIds;                      // node index -> leaf id, -1 for interior nodes
     int minSplit;
+    SplitMethod splitMethod;
+    bool wide;
+    bool watertight;
     int numberOfNodes;
+    int numberOfLeaves;
+    int depth;              // of the deepest leaf, the root is at 0
+    float sahCost;
+    float buildSahCost;     // before any refit
 };
 
 #endif
\ No newline at end of file
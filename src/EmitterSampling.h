@@ -0,0 +1,109 @@
+#ifndef EMITTER_SAMPLING_H
+#define EMITTER_SAMPLING_H
+
+#include <vector>
+#include <algorithm>
+#include "Vec3.h"
+#include "Model.h"
+#include "Instance.h"
+#include "Random.h"
+
+/*
+* Samples points on the triangles of the emissive models and instances (emitted
+* level > 0), with a probability proportional to their area in world space, for
+* next event estimation.
+*/
+class EmitterSampling {
+public:
+    struct Sample {
+        Vec3<float> position;
+        Vec3<float> normal;     // face normal of the sampled triangle
+        Vec3<float> emission;
+        float probability;      // density with respect to the area
+    };
+
+    EmitterSampling(): totalArea(0.f) {}
+
+    EmitterSampling(const std::vector<Model*>& models,
+                    const std::vector<Instance*>& instances = std::vector<Instance*>()): totalArea(0.f) {
+        for (const Model* model: models)
+            addTriangles(*model, nullptr);
+        for (const Instance* instance: instances)
+            addTriangles(instance->getMesh(), instance);
+    }
+
+    bool empty() const { return triangles.empty(); }
+
+    // Area density of any point on an emitter
+    float getProbability() const { return 1.f / totalArea; }
+
+    bool sample(Random& rng, Sample& s) const {
+        if (empty())
+            return false;
+
+        // Pick a triangle according to its area
+        float r = rng.nextFloat() * totalArea;
+        std::size_t t = std::upper_bound(cumulativeArea.begin(), cumulativeArea.end(), r) - cumulativeArea.begin();
+        const EmissiveTriangle& emissive = triangles[std::min(t, triangles.size() - 1)];
+
+        // Uniform point in the triangle
+        const Model& model = *emissive.m;
+        const auto& vertices = model.getVertices();
+        const auto& triangle = model.getIndices()[emissive.index];
+        float u = std::sqrt(rng.nextFloat());
+        float v = rng.nextFloat();
+        s.position = (1.f - u) * vertices[triangle[0]]
+                   + (u * (1.f - v)) * vertices[triangle[1]]
+                   + (u * v) * vertices[triangle[2]];
+        s.normal = model.getFaceNormals()[emissive.index];
+        const Material& material = emissive.instance ? emissive.instance->getMaterial() : model.getMaterial();
+        if (emissive.instance) {
+            s.position = emissive.instance->getTransform().applyToPoint(s.position);
+            s.normal = normalize(emissive.instance->getTransform().applyToNormal(s.normal));
+        }
+        s.emission = material.getEmittedLevel() * material.getColor();
+        s.probability = getProbability();
+        return true;
+    }
+
+private:
+    struct EmissiveTriangle {
+        const Model* m;
+        const Instance* instance;   // nullptr for a model of the scene
+        int index;
+    };
+
+    // Triangles of the model placed by the instance, if any, with their area in world space
+    void addTriangles(const Model& model, const Instance* instance) {
+        const Material& material = instance ? instance->getMaterial() : model.getMaterial();
+        if (material.getEmittedLevel() <= 0.f)
+            return;
+
+        const auto& vertices = model.getVertices();
+        const auto& indices = model.getIndices();
+        for (std::size_t i = 0; i < indices.size(); i++) {
+            const auto& triangle = indices[i];
+            Vec3<float> v0 = vertices[triangle[0]];
+            Vec3<float> v1 = vertices[triangle[1]];
+            Vec3<float> v2 = vertices[triangle[2]];
+            if (instance) {
+                v0 = instance->getTransform().applyToPoint(v0);
+                v1 = instance->getTransform().applyToPoint(v1);
+                v2 = instance->getTransform().applyToPoint(v2);
+            }
+            float area = 0.5f * cross(v1 - v0, v2 - v0).length();
+            if (area <= 0.f)
+                continue;
+
+            totalArea += area;
+            triangles.push_back({&model, instance, (int) i});
+            cumulativeArea.push_back(totalArea);
+        }
+    }
+
+    std::vector<EmissiveTriangle> triangles;
+    std::vector<float> cumulativeArea;
+    float totalArea;
+};
+
+#endif
\ No newline at end of file
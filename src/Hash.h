@@ -0,0 +1,25 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <cstdint>
+#include <cstddef>
+
+/*
+* 64-bit FNV-1a hash, chained by passing the previous hash as the seed.
+* source: http://www.isthe.com/chongo/tech/comp/fnv/index.html
+*/
+inline uint64_t hashBytes(const void* data, std::size_t size, uint64_t hash = 14695981039346656037ULL) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (std::size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+template <typename T>
+inline uint64_t hashValue(const T& value, uint64_t hash = 14695981039346656037ULL) {
+    return hashBytes(&value, sizeof(T), hash);
+}
+
+#endif
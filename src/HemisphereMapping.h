@@ -1,59 +1,108 @@
 #include <vector>
-#include <numeric>      // std::partial_sum
 #include "Vec3.h"
 #include "HemisphereSampling.h"
-
+#include "AtomicFloat.h"
+
+/*
+* Grid of values over the hemisphere, directions are sampled proportionally to
+* them. A Fenwick tree over the grid keeps its prefix sums, so that updating a
+* value and sampling a direction both take O(log n) without allocating. The tree
+* only ever receives changes of the values: it is held in double, so that its
+* rounding errors stay far below the values after millions of updates, and the
+* directions keep following the probabilities reported for them.
+* source: Fenwick, A New Data Structure for Cumulative Frequency Tables, 1994
+*/
 class HemisphereMapping : public HemisphereSampling {
 public:
-    HemisphereMapping(int resX, int resY): resX(resX), resY(resY), grid(resX*resY, 1.f) {}
+    HemisphereMapping(int resX, int resY): resX(resX), resY(resY), grid(resX*resY, 1.f),
+                                           tree(resX*resY + 1, 0.f), total(resX*resY) {
+        // Node i sums the lowbit(i) values ending at i
+        for (int i = 1; i <= resX*resY; i++)
+            tree[i].store(i & -i);
+
+        topStep = 1;
+        while (topStep * 2 <= resX*resY)
+            topStep *= 2;
+    }
 
-    std::size_t size() {
+    std::size_t size() const {
         return grid.size();
     }
 
-    const float getValue(int idx) {
-        return grid[idx];
+    // The values may be updated by other threads at any time
+    float getValue(int idx) const {
+        return grid[idx].load();
+    }
+
+    Vec3<float> getDir(int idx, Random& rng) const {
+        return normalize(mapIndexToDirection(idx, rng));
+    }
+
+    // Direction at the given shifts in [0, 1) inside the cell
+    Vec3<float> getDir(int idx, float shiftX, float shiftY) const {
+        return normalize(mapIndexToDirection(idx, shiftX, shiftY));
     }
 
-    Vec3<float> getDir(int idx) {
-        return normalize(mapIndexToDirection(idx));
+    // Moves the value towards target by the learning rate lr, safe with other threads:
+    // the change is then added to the nodes of the tree covering the value
+    void updateByIndex(int idx, float target, float lr) {
+        double delta = grid[idx].blend(target, lr);
+        for (int i = idx + 1; i < (int) tree.size(); i += i & -i)
+            tree[i].add(delta);
+        total.add(delta);
     }
 
-    void updateByIndex(int idx, float update) {
-        grid[idx] = update;
+    // Replaces every value, not safe with other threads
+    void setValues(const float* values) {
+        double sum = 0.;
+        for (std::size_t i = 0; i < grid.size(); i++) {
+            grid[i].store(values[i]);
+            tree[i + 1].store(values[i]);
+            sum += values[i];
+        }
+        total.store(sum);
+
+        // Each node adds itself to its parent, in O(n)
+        for (int i = 1; i < (int) tree.size(); i++) {
+            int parent = i + (i & -i);
+            if (parent < (int) tree.size())
+                tree[parent].add(tree[i].load());
+        }
     }
 
-    void sampleDirection(Sample& s) const override {
-        // Random float between 0. and 1.
-        float r = static_cast <float> (rand()) / static_cast <float> (RAND_MAX);
-
-        // Normalize the grid: floats -> floats between 0. and 1.
-        //    - q /= (sum of all q's)
-        //    - try a softmax approach ?
-        std::vector<float> normalizedGrid(grid.size());
-        float sum = 0.f;
-        for (std::size_t i = 0; i < grid.size(); i++)
-            sum += grid[i];
-        for (std::size_t i = 0; i < grid.size(); i++)
-            normalizedGrid[i] = grid[i] / sum;
-        // Cumulative sum
-        std::vector<float> cumulative(grid.size());
-        std::partial_sum(normalizedGrid.begin(), normalizedGrid.end(), cumulative.begin());
-
-        // Pick the right index
-        s.index = grid.size() - 1;
-        for (int i = 0; i < (int) cumulative.size(); i++) {
-            if (r < cumulative[i]) {
-                s.index = i;
-                break;
+    void sampleDirection(Sample& s, Random& rng) const override {
+        double sum = total.load();
+
+        // Descend the tree to the first value whose prefix sum exceeds r
+        double r = rng.nextFloat() * sum;
+        int idx = 0;
+        for (int step = topStep; step > 0; step /= 2) {
+            if (idx + step < (int) tree.size() && tree[idx + step].load() <= r) {
+                idx += step;
+                r -= tree[idx].load();
             }
         }
-        s.direction = normalize(mapIndexToDirection(s.index));
-        s.probability = ((float) grid.size() * normalizedGrid[s.index]) / (2.f * M_PI);
+        s.index = std::min(idx, (int) grid.size() - 1);
+
+        s.direction = normalize(mapIndexToDirection(s.index, rng));
+        s.probability = ((float) grid.size() * grid[s.index].load() / (float) sum) / (2.f * M_PI);
+    }
+
+    float probability(const Vec3<float>& direction) const override {
+        if (direction[2] <= 0.f)
+            return 0.f;
+
+        return ((float) grid.size() * grid[mapDirectionToIndex(direction)].load() / (float) total.load()) / (2.f * M_PI);
     }
 
 private:
-    Vec3<float> mapIndexToDirection(int dirIndex) const {
+    Vec3<float> mapIndexToDirection(int dirIndex, Random& rng) const {
+        float randomShiftX = rng.nextFloat();
+        float randomShiftY = rng.nextFloat();
+        return mapIndexToDirection(dirIndex, randomShiftX, randomShiftY);
+    }
+
+    Vec3<float> mapIndexToDirection(int dirIndex, float randomShiftX, float randomShiftY) const {
         int idxX = dirIndex % resX;
         int idxY = dirIndex / resX;
 
@@ -62,8 +111,6 @@ private:
 
         float sizeX = 1.f / (float) (resX);
         float sizeY = 1.f / (float) (resY);
-        float randomShiftX = static_cast <float> (rand()) / static_cast <float> (RAND_MAX);
-        float randomShiftY = static_cast <float> (rand()) / static_cast <float> (RAND_MAX);
 
         float x = ((float) idxX + randomShiftX) * sizeX;
         float y = ((float) idxY + randomShiftY) * sizeY;
@@ -72,6 +119,17 @@ private:
         return simpleMap(x, y);
     }
 
+    // Inverse of mapIndexToDirection() with simpleMap()
+    int mapDirectionToIndex(const Vec3<float>& direction) const {
+        float phi = std::atan2(direction[1], direction[0]);
+        if (phi < 0.f)
+            phi += 2.f * M_PI;
+
+        int idxX = std::min((int) (direction[2] * resX), resX - 1);
+        int idxY = std::min((int) (phi / (2.f * M_PI) * resY), resY - 1);
+        return idxX + idxY * resX;
+    }
+
     Vec3<float> simpleMap(float x, float y) const {
         // Bad implementation according to https://mathworld.wolfram.com/SpherePointPicking.html
         //float theta = M_PI * x * 0.5f;
@@ -187,5 +245,8 @@ private:
 
     int resX;
     int resY;
-    std::vector<float> grid;
+    std::vector<AtomicFloat> grid;
+    std::vector<AtomicDouble> tree; // Fenwick tree of the grid, 1-based
+    AtomicDouble total;             // sum of the grid
+    int topStep;                    // highest power of 2 <= grid size
 };
@@ -3,9 +3,12 @@
 
 #include "Vec3.h"
 #include "Ray.h"
+#include "Random.h"
 
 class HemisphereSampling {
 public:
+    virtual ~HemisphereSampling() = default;
+
     struct Sample {
         Vec3<float> direction;
         // extra info
@@ -20,14 +23,19 @@ public:
         return Vec3<float>(std::cos(phi) * r, std::sin(phi) * r, u1);
     }
 
-    virtual void sampleDirection(Sample& s) const {
+    virtual void sampleDirection(Sample& s, Random& rng) const {
         //std::cout << "RandomSampling" << std::endl;
-        float u1 = static_cast <float> (rand()) / static_cast <float> (RAND_MAX);
-        float u2 = static_cast <float> (rand()) / static_cast <float> (RAND_MAX);
+        float u1 = rng.nextFloat();
+        float u2 = rng.nextFloat();
 
         s.direction = uniformSample(u1, u2);
         s.probability = 1.f / (2.f * M_PI);
     }
+
+    // Density of sampling the direction, given in tangent space
+    virtual float probability(const Vec3<float>& direction) const {
+        return direction[2] > 0.f ? 1.f / (2.f * M_PI) : 0.f;
+    }
 };
 
 class CosigneWeighted : public HemisphereSampling {
@@ -43,16 +51,20 @@ public:
         return Vec3<float>(x, y, std::sqrt(std::max(0.0f, 1 - u1)));
     }
 
-    void sampleDirection(Sample& s) const override {
+    void sampleDirection(Sample& s, Random& rng) const override {
         //std::cout << "CosigneWeighted" << std::endl;
-        float u1 = static_cast <float> (rand()) / static_cast <float> (RAND_MAX);
-        float u2 = static_cast <float> (rand()) / static_cast <float> (RAND_MAX);
+        float u1 = rng.nextFloat();
+        float u2 = rng.nextFloat();
 
         // direction in tangent space
         s.direction = cosineWeightedSample(u1, u2);
         float cosAngle = std::max(dot(Vec3<float>(0.f, 0.f, 1.f), s.direction), 0.f);
         s.probability = cosAngle / M_PI;
     }
+
+    float probability(const Vec3<float>& direction) const override {
+        return std::max(direction[2], 0.f) / M_PI;
+    }
 };
 
 #endif
\ No newline at end of file
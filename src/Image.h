@@ -5,6 +5,7 @@
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <algorithm>
 #include "Vec3.h"
 
 class Image {
@@ -31,9 +32,9 @@ public:
         PPMfile << 255 << std::endl;
 
         for(int i = 0; i < width*height; i++) {
-            PPMfile << (int)(img[i][0]*255) << " ";
-            PPMfile << (int)(img[i][1]*255) << " ";
-            PPMfile << (int)(img[i][2]*255) << std::endl;
+            PPMfile << toByte(img[i][0]) << " ";
+            PPMfile << toByte(img[i][1]) << " ";
+            PPMfile << toByte(img[i][2]) << std::endl;
         }
 
         PPMfile.close();
@@ -62,6 +63,11 @@ public:
     }
 
 private:
+    // Path traced radiance is not bounded by 1
+    static int toByte(float v) {
+        return (int)(std::min(std::max(v, 0.f), 1.f)*255);
+    }
+
     // 3 floats value per pixel (RGB)
     std::vector<Vec3<float>> img;
     int width;
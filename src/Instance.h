@@ -0,0 +1,53 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "Model.h"
+#include "Material.h"
+#include "Transform.h"
+#include "AABB.h"
+
+/*
+* Placement of a shared mesh in the scene. The mesh is stored and gets a BVH only
+* once, whatever the number of its instances: an instance only adds an affine
+* transform and its own material, initially the one of the mesh.
+*/
+class Instance {
+public:
+    Instance(Model& mesh, const Transform& transform = Transform()): mesh(&mesh),
+                                                                     material(mesh.getMaterial()) {
+        setTransform(transform);
+    }
+
+    void setTransform(const Transform& transform) {
+        toWorld = transform;
+        toObject = transform.inverse();
+        version = Model::nextVersion();
+    }
+
+    // Applied after the current transform
+    void translate(const Vec3<float>& t) { setTransform(Transform::translation(t) * toWorld); }
+    void scale(const Vec3<float>& s) { setTransform(Transform::scaling(s) * toWorld); }
+    void rotate(const Vec3<float>& axis, float angle) { setTransform(Transform::rotation(axis, angle) * toWorld); }
+
+    // Set functions
+    void setMaterial(const Material& m) { material = m; }
+
+    // Get functions
+    Model& getMesh() const { return *mesh; }
+    const Transform& getTransform() const { return toWorld; }
+    const Transform& getInverse() const { return toObject; }
+    // In world space, follows the mesh when its vertices move
+    AABB getAABB() const { return toWorld.applyToAABB(mesh->getAABB()); }
+    const Material& getMaterial() const { return material; }
+    // Stamp of the transform, it changes whenever the instance moves
+    uint64_t getVersion() const { return version; }
+
+private:
+    Model* mesh;
+    Material material;
+    Transform toWorld;
+    Transform toObject;
+    uint64_t version;
+};
+
+#endif
@@ -0,0 +1,267 @@
+#ifndef INSTANCE_BVH_H
+#define INSTANCE_BVH_H
+
+#include <map>
+#include <memory>
+#include <numeric>
+#include <unordered_map>
+#include "BVH.h"
+#include "Instance.h"
+
+/*
+* Two-level acceleration structure. Each mesh placed by the instances gets its
+* own BVH of triangles (bottom level), shared by all its instances, and a BVH
+* over the bounds of the instances sits on top (top level). A ray reaching an
+* instance is moved to the space of its mesh and traced through the mesh BVH,
+* so the memory grows with the unique geometry only.
+*/
+class InstanceBVH {
+public:
+    InstanceBVH(const std::vector<Instance*>& instances, int minSplit=100,
+                BVH::SplitMethod splitMethod=BVH::SplitMethod::Middle, bool wide=false,
+                bool watertight=false): instances(instances),
+                                        minSplit(minSplit),
+                                        splitMethod(splitMethod),
+                                        wide(wide),
+                                        watertight(watertight),
+                                        numberOfLeaves(0) {
+        if (instances.size() == 0)
+            throw std::length_error("Length of instances vector is 0.");
+
+        for (std::size_t i = 0; i < instances.size(); i++) {
+            Model* mesh = &instances[i]->getMesh();
+            if (meshBVHs.find(mesh) == meshBVHs.end()) {
+                meshBVHs[mesh] = buildMeshBVH(mesh);
+                meshVersions[mesh] = mesh->getVersion();
+            }
+            instanceIndex[instances[i]] = i;
+        }
+
+        std::cout << "InstanceBVH.h" << std::endl;
+        std::cout << "      Building top-level BVH.. ";
+        buildTopLevel();
+        std::cout << "Done" << std::endl;
+        printInfos();
+    }
+
+    // Brings the BVH up to date after instances or meshes moved. The BVH of a mesh
+    // that moved is refitted, or rebuilt when its SAH cost grows past rebuildThreshold
+    // times its cost when built (always with a threshold <= 0). The top level is
+    // rebuilt, it only holds the instances. Returns the number of mesh BVHs rebuilt.
+    int update(float rebuildThreshold, int& refitted) {
+        int rebuilt = 0;
+        refitted = 0;
+        for (auto& mesh: meshBVHs) {
+            Model* model = const_cast<Model*>(mesh.first);
+            if (meshVersions[model] == model->getVersion())
+                continue;
+
+            meshVersions[model] = model->getVersion();
+            if (rebuildThreshold > 0.f && mesh.second->refit() <= rebuildThreshold * mesh.second->getBuildSAHCost()) {
+                refitted++;
+            } else {
+                mesh.second = buildMeshBVH(model);
+                rebuilt++;
+            }
+        }
+
+        buildTopLevel();
+        return rebuilt;
+    }
+
+    // Closest hit among the instances within the interval of the ray, whose tMax
+    // shrinks to the hit. The normals of the hit are moved back to world space.
+    bool intersect(const Ray& ray, Ray::Hit& hit) const {
+        bool foundHit = false;
+        int stack[maxStackSize];
+        int stackSize = 0;
+        int nodeIndex = 0;
+        while (true) {
+            const BVH::LinearNode& node = nodes[nodeIndex];
+            float tEntry;
+            if (ray.intersectAABB(node.aabb, tEntry)) {
+                if (!node.isLeaf()) {
+                    // Nearer child first
+                    if (ray.getSign(node.axis)) {
+                        stack[stackSize++] = nodeIndex + 1;
+                        nodeIndex = node.secondChildOffset;
+                    } else {
+                        stack[stackSize++] = node.secondChildOffset;
+                        nodeIndex = nodeIndex + 1;
+                    }
+                    continue;
+                }
+
+                for (int i = node.primitivesOffset; i < node.primitivesOffset + node.nPrimitives; i++)
+                    if (intersectInstance(ray, order[i], hit))
+                        foundHit = true;
+            }
+
+            if (stackSize == 0)
+                return foundHit;
+            nodeIndex = stack[--stackSize];
+        }
+    }
+
+    // Any hit within [epsilon, tMax] of the ray among the instances
+    bool occluded(const Ray& ray) const {
+        int stack[maxStackSize];
+        int stackSize = 0;
+        int nodeIndex = 0;
+        while (true) {
+            const BVH::LinearNode& node = nodes[nodeIndex];
+            float tEntry;
+            if (ray.intersectAABB(node.aabb, tEntry)) {
+                if (!node.isLeaf()) {
+                    stack[stackSize++] = node.secondChildOffset;
+                    nodeIndex = nodeIndex + 1;
+                    continue;
+                }
+
+                for (int i = node.primitivesOffset; i < node.primitivesOffset + node.nPrimitives; i++)
+                    if (instanceBVHs[order[i]]->occluded(toObject(ray, *instances[order[i]])))
+                        return true;
+            }
+
+            if (stackSize == 0)
+                return false;
+            nodeIndex = stack[--stackSize];
+        }
+    }
+
+    // Leaves of the mesh BVHs, counted once for each of their instances
+    int getNumberOfLeaves() const { return numberOfLeaves; }
+    // Leaf of the mesh BVH holding the triangle hit, numbered among the leaves of all instances
+    int getLeafId(const Ray::Hit& hit) const {
+        int i = instanceIndex.at(hit.instance);
+        return firstLeaf[i] + instanceBVHs[i]->getLeafId(static_cast<const BVH::LinearNode*>(hit.info));
+    }
+
+    void printInfos() const {
+        std::size_t uniqueTriangles = 0, instancedTriangles = 0;
+        for (const auto& mesh: meshBVHs)
+            uniqueTriangles += mesh.first->getIndices().size();
+        for (const Instance* instance: instances)
+            instancedTriangles += instance->getMesh().getIndices().size();
+
+        std::cout << "      # of instances:     " << instances.size() << std::endl;
+        std::cout << "      # of meshes:        " << meshBVHs.size() << std::endl;
+        std::cout << "      top-level nodes:    " << nodes.size() << std::endl;
+        std::cout << "      triangles:          " << uniqueTriangles << " unique, "
+                  << instancedTriangles << " instanced" << std::endl;
+        std::cout << "      memory (KB):        " << (nodes.size() * sizeof(BVH::LinearNode)
+                                                      + order.size() * sizeof(int)
+                                                      + instances.size() * (sizeof(Instance*) + sizeof(BVH*) + sizeof(int))) / 1024
+                  << " (without the mesh BVHs)" << std::endl;
+    }
+
+private:
+    std::unique_ptr<BVH> buildMeshBVH(Model* mesh) const {
+        return std::make_unique<BVH>(std::vector<Model*>{mesh}, minSplit, splitMethod, wide, watertight);
+    }
+
+    // The leaves of each instance are numbered after those of the previous ones
+    void buildTopLevel() {
+        instanceBVHs.clear();
+        firstLeaf.clear();
+        numberOfLeaves = 0;
+        instanceBounds.clear();
+        for (const Instance* instance: instances) {
+            const BVH* bvh = meshBVHs.at(&instance->getMesh()).get();
+            instanceBVHs.push_back(bvh);
+            firstLeaf.push_back(numberOfLeaves);
+            numberOfLeaves += bvh->getNumberOfLeaves();
+            instanceBounds.push_back(instance->getAABB());
+        }
+
+        nodes.clear();
+        nodes.reserve(2 * instances.size());
+        order.resize(instances.size());
+        std::iota(order.begin(), order.end(), 0);
+        build(0, instances.size());
+    }
+
+    // Ray in the space of the mesh of the instance. The direction is not normalized,
+    // so that distances along the ray are the same in both spaces. The determinant of
+    // a triangle test is a triple product, scaled by the determinant of the inverse
+    // transform in object space: so is its epsilon, so that a scaled instance takes
+    // the same rays as parallel to its triangles as the mesh transformed in place.
+    static Ray toObject(const Ray& ray, const Instance& instance) {
+        const Transform& inverse = instance.getInverse();
+        Ray local(inverse.applyToPoint(ray.getOrigin()), inverse.applyToVector(ray.getDirection()));
+        local.setTMax(ray.getTMax());
+        local.setDeterminantEpsilon(ray.getDeterminantEpsilon() * std::abs(inverse.determinant()));
+        return local;
+    }
+
+    bool intersectInstance(const Ray& ray, int i, Ray::Hit& hit) const {
+        const Instance& instance = *instances[i];
+        Ray local = toObject(ray, instance);
+        if (!instanceBVHs[i]->intersect(local, hit))
+            return false;
+
+        ray.setTMax(local.getTMax());
+        const Transform& transform = instance.getTransform();
+        hit.faceNormal = normalize(transform.applyToNormal(hit.faceNormal));
+        hit.interpolatedNormal = normalize(transform.applyToNormal(hit.interpolatedNormal));
+        hit.instance = &instance;
+        return true;
+    }
+
+    // Splits the instances at the median of their centroids along the longest axis,
+    // so that the depth stays below log2 of their number. Returns the index of the node.
+    int build(int begin, int end) {
+        int nodeIndex = nodes.size();
+        nodes.emplace_back();
+
+        AABB bounds, centroidBounds;
+        for (int i = begin; i < end; i++) {
+            bounds.update(instanceBounds[order[i]]);
+            centroidBounds.update(instanceBounds[order[i]].getCentroid());
+        }
+        nodes[nodeIndex].aabb = bounds;
+
+        if (end - begin <= maxInstancesInLeaf) {
+            nodes[nodeIndex].primitivesOffset = begin;
+            nodes[nodeIndex].nPrimitives = end - begin;
+            nodes[nodeIndex].leaf = 1;
+            return nodeIndex;
+        }
+
+        Vec3<float> extent = centroidBounds.getMaxBound() - centroidBounds.getMinBound();
+        int axis = extent[0] > extent[1] ? 0 : 1;
+        axis = extent[axis] > extent[2] ? axis : 2;
+        int middle = (begin + end) / 2;
+        std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end, [&](int a, int b) {
+            return instanceBounds[a].getCentroid()[axis] < instanceBounds[b].getCentroid()[axis];
+        });
+
+        build(begin, middle);
+        int second = build(middle, end);
+        nodes[nodeIndex].secondChildOffset = second;
+        nodes[nodeIndex].nPrimitives = 0;
+        nodes[nodeIndex].axis = axis;
+        nodes[nodeIndex].leaf = 0;
+        return nodeIndex;
+    }
+
+    static constexpr int maxInstancesInLeaf = 2;
+    static constexpr int maxStackSize = 64;    // median splits: depth <= log2(#instances)
+
+    std::vector<Instance*> instances;
+    int minSplit;
+    BVH::SplitMethod splitMethod;
+    bool wide;
+    bool watertight;
+    std::map<const Model*, std::unique_ptr<BVH>> meshBVHs;
+    std::map<const Model*, uint64_t> meshVersions;  // of the vertices the mesh BVHs were built on
+    std::vector<const BVH*> instanceBVHs;           // BVH of the mesh of each instance
+    std::vector<int> firstLeaf;                     // id of the first leaf of each instance
+    std::unordered_map<const Instance*, int> instanceIndex;
+    std::vector<BVH::LinearNode> nodes;             // top level, depth-first like BVH
+    std::vector<int> order;                         // instances referenced by the leaves
+    std::vector<AABB> instanceBounds;               // world bounds of the instances, for the build
+    int numberOfLeaves;
+};
+
+#endif
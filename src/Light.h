@@ -2,6 +2,7 @@
 #define LIGHT_H
 
 #include "Vec3.h"
+#include "Random.h"
 
 class Light {
 public:
@@ -10,6 +11,8 @@ public:
 
     // const Vec3<float>& getPosition() const { return position; }
     virtual Vec3<float> getPosition() const { return position; }
+    // Point on the light, random for lights with an area
+    virtual Vec3<float> samplePosition(Random& rng) const { return position; }
     const Vec3<float>& getColor() const { return color; }
     const float& getIntensity() const { return intensity; }
 
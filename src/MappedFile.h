@@ -0,0 +1,86 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstddef>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+* Read-only view of a whole file. The file is memory-mapped, so its pages are
+* only read from the disk when they are first accessed. Without mmap (_WIN32)
+* the file is read into memory instead.
+* With copyOnWrite, the contents may be modified: the modified pages become
+* private copies and the file itself is never written.
+*/
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& filename, bool copyOnWrite = false): bytes(nullptr), length(0) {
+#ifndef _WIN32
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+
+        struct stat status;
+        bool empty = false;
+        if (::fstat(fd, &status) == 0) {
+            empty = status.st_size == 0;
+            int protection = copyOnWrite ? PROT_READ | PROT_WRITE : PROT_READ;
+            void* address = empty ? MAP_FAILED : ::mmap(nullptr, status.st_size, protection, MAP_PRIVATE, fd, 0);
+            if (address != MAP_FAILED) {
+                bytes = static_cast<char*>(address);
+                length = status.st_size;
+                mapped = true;
+                // The arrays of the file are read from start to end
+                ::madvise(address, length, MADV_SEQUENTIAL);
+            }
+        }
+        ::close(fd);
+        if (mapped || empty) {
+            opened = true;
+            return;
+        }
+#endif
+        std::ifstream file(filename, std::ios::binary | std::ios::ate);
+        if (!file)
+            return;
+
+        buffer.resize(file.tellg());
+        file.seekg(0);
+        if (!buffer.empty() && !file.read(buffer.data(), buffer.size()))
+            return;
+        bytes = buffer.data();
+        length = buffer.size();
+        opened = true;
+    }
+
+    ~MappedFile() {
+#ifndef _WIN32
+        if (mapped)
+            ::munmap(bytes, length);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool isOpen() const { return opened; }
+    const char* data() const { return bytes; }
+    char* data() { return bytes; }     // only written when opened copyOnWrite
+    std::size_t size() const { return length; }
+
+private:
+    char* bytes;
+    std::size_t length;
+    bool opened = false;
+    bool mapped = false;
+    std::vector<char> buffer;   // contents of the file when it is not mapped
+};
+
+#endif
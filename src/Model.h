@@ -2,108 +2,396 @@
 #define MODEL_H
 
 #include <vector>
+#include <memory>
+#include <atomic>
 #include <fstream>
-#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <charconv>
+#include <filesystem>
+#include <string_view>
 #include "Vec3.h"
 #include "Material.h"
 #include "AABB.h"
+#include "MappedFile.h"
+#include "ArrayView.h"
+#include "Hash.h"
 
 class Model {
 public:
     // Constructors
+    // The mesh is loaded from its binary cache, next to the file, when it is up to
+    // date. Otherwise the file is parsed and the cache is written for the next runs.
     Model(std::string filename) {
-        std::ifstream file;
-        file.open(filename);
-        if (file.fail()) {
+        MappedFile file(filename);
+        if (!file.isOpen()) {
             std::cout << "Model.h" << std::endl;
             std::cout << "      Fail opening file: " << filename << std::endl;
             return;
         }
 
-        std::string line;
-        std::getline(file, line);
-        if(line.compare("OFF") == 0) {
+        std::string cacheFilename = filename + ".mesh";
+        int64_t sourceTime = modificationTime(filename);
+        if (loadMeshCache(cacheFilename, file, sourceTime))
+            return;
+
+        const char* begin = file.data();
+        const char* end = begin + file.size();
+        if (nextToken(begin, end) == "OFF") {
             std::cout << "Model.h" << std::endl;
             std::cout << "      Loading OFF file: " << filename << std::endl;
-            loadOFF(file);
+            loadOFF(begin, end);
         }
 
         aabb.compute(vertices);
         computeFaceNormals();
         computeVertexNormals();
+        bindArrays();
+
+        if (!vertices.empty())
+            saveMeshCache(cacheFilename, file.size(), sourceTime, hashBytes(file.data(), file.size()));
     }
 
     Model(const std::vector<Vec3<float>>& vertices, const std::vector<Vec3<int>>& indices):
             vertices(vertices), indices(indices), aabb(vertices) {
         computeFaceNormals();
         computeVertexNormals();
+        bindArrays();
+    }
+
+    // A copy owns its arrays, even when the original is mapped
+    Model(const Model& other): vertices(other.vertexArray.begin(), other.vertexArray.end()),
+                               vertexNormals(other.vertexNormalArray.begin(), other.vertexNormalArray.end()),
+                               indices(other.indexArray.begin(), other.indexArray.end()),
+                               faceNormals(other.faceNormalArray.begin(), other.faceNormalArray.end()),
+                               centroid(other.centroid), material(other.material), aabb(other.aabb) {
+        bindArrays();
     }
 
+    // Moving a vector or the mapping keeps its address, the arrays stay valid
+    Model(Model&&) = default;
+    Model& operator=(Model&&) = default;
+
+    Model& operator=(const Model& other) {
+        return *this = Model(other);
+    }
+
+    // A mapped mesh is modified in place, its pages are then copied on write
     void translate(const Vec3<float>& t) {
-        for (auto& v: vertices)
+        for (auto& v: vertexArray)
             v += t;
-        aabb.compute(vertices);
+        aabb.compute(vertexArray);
+        version = nextVersion();
     }
 
     void scale(const Vec3<float>& t) {
-        for (auto& v: vertices)
+        for (auto& v: vertexArray)
             v *= t;
-        aabb.compute(vertices);
+        aabb.compute(vertexArray);
+        version = nextVersion();
+    }
+
+    // Stamp of the vertices, it changes whenever they move. Stamps are never reused,
+    // so no other model or instance ever has the same one.
+    uint64_t getVersion() const { return version; }
+
+    static uint64_t nextVersion() {
+        static std::atomic<uint64_t> counter(0);
+        return ++counter;
     }
 
     // Set functions
     void setMaterial(const Material& m) { material = m; }
 
     // Get functions
-    const std::vector<Vec3<float>>& getVertices() const { return vertices; }
-    const std::vector<Vec3<int>>& getIndices() const { return indices; }
-    const std::vector<Vec3<float>>& getFaceNormals() const { return faceNormals; }
-    const std::vector<Vec3<float>>& getVertexNormals() const { return vertexNormals; }
+    ArrayView<const Vec3<float>> getVertices() const { return {vertexArray.data(), vertexArray.size()}; }
+    ArrayView<const Vec3<int>> getIndices() const { return {indexArray.data(), indexArray.size()}; }
+    ArrayView<const Vec3<float>> getFaceNormals() const { return {faceNormalArray.data(), faceNormalArray.size()}; }
+    ArrayView<const Vec3<float>> getVertexNormals() const { return {vertexNormalArray.data(), vertexNormalArray.size()}; }
     const AABB& getAABB() const { return aabb; }
     const Material& getMaterial() const { return material; }
 
 private:
-    void loadOFF(std::ifstream& file) {
+    static bool isBlank(char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    }
+
+    // Moves to the start of the next line holding data, skips blank lines and comments
+    static const char* skipToData(const char* p, const char* end) {
+        while (p < end) {
+            if (isBlank(*p)) {
+                p++;
+            } else if (*p == '#') {
+                p = std::find(p, end, '\n');
+            } else {
+                break;
+            }
+        }
+        return p;
+    }
+
+    // Reads a whitespace separated word, moves begin past it
+    static std::string_view nextToken(const char*& begin, const char* end) {
+        const char* p = skipToData(begin, end);
+        const char* q = p;
+        while (q < end && !isBlank(*q) && *q != '#')
+            q++;
+        begin = q;
+        return std::string_view(p, q - p);
+    }
+
+    // Reads a number of the line, moves p past it, false at the end of the line
+    template <typename T>
+    static bool parseNumber(const char*& p, const char* end, T& value) {
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+        if (p < end && *p == '+')
+            p++;
+        auto result = std::from_chars(p, end, value);
+        if (result.ec != std::errc())
+            return false;
+        p = result.ptr;
+        return true;
+    }
+
+    /*
+    * The lines of the file are found by a sequential scan, then they are parsed
+    * in parallel straight from the mapped file into the vertices and indices.
+    * Faces with more than 3 vertices are split into triangle fans.
+    */
+    void loadOFF(const char* p, const char* end) {
         vertices.clear();
         indices.clear();
 
-        int i = 0;
-        std::string line;
         int numberOfVertices = -1, numberOfFaces = -1, numberOfEdges = -1;
-        while (std::getline(file, line)) {
-            std::istringstream iss(line);
-            if (line.empty() || line[0] == '#') {
+        p = skipToData(p, end);
+        if (!parseNumber(p, end, numberOfVertices) || !parseNumber(p, end, numberOfFaces) || numberOfVertices < 0 || numberOfFaces < 0) {
+            std::cout << "      Wrong header" << std::endl;
+            return;
+        }
+        parseNumber(p, end, numberOfEdges);
+        std::cout << "      #vertices: " << numberOfVertices << std::endl;
+        std::cout << "      #faces: " << numberOfFaces << std::endl;
+        std::cout << "      #edges: " << numberOfEdges << std::endl;
+
+        std::vector<const char*> lines;
+        lines.reserve((std::size_t) numberOfVertices + numberOfFaces + 1);
+        p = std::find(p, end, '\n');
+        for (int i = 0; i < numberOfVertices + numberOfFaces; i++) {
+            p = skipToData(p, end);
+            if (p == end)
+                break;
+            lines.push_back(p);
+            p = std::find(p, end, '\n');
+        }
+        lines.push_back(end);
+        int numberOfLines = (int) lines.size() - 1;
+        if (numberOfLines < numberOfVertices + numberOfFaces)
+            std::cout << "      Missing lines: " << numberOfVertices + numberOfFaces - numberOfLines << std::endl;
+        numberOfVertices = std::min(numberOfVertices, numberOfLines);
+        numberOfFaces = numberOfLines - numberOfVertices;
+
+        int badVertices = 0;
+        vertices.resize(numberOfVertices);
+        #pragma omp parallel for reduction(+:badVertices) if(numberOfVertices > 10000)
+        for (int i = 0; i < numberOfVertices; i++) {
+            const char* q = lines[i];
+            float x, y, z;
+            if (parseNumber(q, lines[i+1], x) && parseNumber(q, lines[i+1], y) && parseNumber(q, lines[i+1], z)) {
+                vertices[i] = Vec3<float>(x, y, z);
+            } else {
+                vertices[i] = Vec3<float>(0.f, 0.f, 0.f);
+                badVertices++;
+            }
+        }
+        if (badVertices > 0)
+            std::cout << "      Malformed vertices: " << badVertices << std::endl;
+
+        // A face of n vertices gives n-2 triangles, their prefix sum places them in indices
+        const char* const* faceLines = lines.data() + numberOfVertices;
+        std::vector<int> firstTriangle(numberOfFaces + 1, 0);
+        #pragma omp parallel for if(numberOfFaces > 10000)
+        for (int i = 0; i < numberOfFaces; i++) {
+            const char* q = faceLines[i];
+            int numberOfIndices;
+            if (parseNumber(q, faceLines[i+1], numberOfIndices) && numberOfIndices >= 3)
+                firstTriangle[i+1] = numberOfIndices - 2;
+        }
+        for (int i = 0; i < numberOfFaces; i++)
+            firstTriangle[i+1] += firstTriangle[i];
+
+        // Triangles of faces with wrong indices are marked with -1, removed below
+        int badFaces = 0;
+        indices.resize(firstTriangle[numberOfFaces]);
+        #pragma omp parallel for reduction(+:badFaces) if(numberOfFaces > 10000)
+        for (int i = 0; i < numberOfFaces; i++) {
+            int numberOfTriangles = firstTriangle[i+1] - firstTriangle[i];
+            if (numberOfTriangles == 0) {
+                badFaces++;
                 continue;
-            } else if (i == 0) {
-                iss >> numberOfVertices;
-                iss >> numberOfFaces;
-                iss >> numberOfEdges;
-                std::cout << "      #vertices: " << numberOfVertices << std::endl;
-                std::cout << "      #faces: " << numberOfFaces << std::endl;
-                std::cout << "      #edges: " << numberOfEdges << std::endl;
-            } else if (numberOfVertices-- > 0) {
-                float x, y, z;
-                if (!(iss >> x >> y >> z))
-                    break;  // error
-                vertices.push_back(Vec3<float>(x, y, z));
-            } else if (numberOfFaces-- > 0) {
-                int numberOfIndices;
-                int i1, i2, i3; // suppose it's 3
-
-                if (!(iss >> numberOfIndices))
-                    break;  // error
-                if (numberOfIndices != 3) {
-                    std::cout << "      Wrong number of vertices by face: " << numberOfIndices << std::endl;
-                    break;
-                }
-                if (!(iss >> i1 >> i2 >> i3))
-                    break;  // error
-
-                indices.push_back(Vec3<int>(i1, i2, i3));
             }
 
-            i++;
+            const char* q = faceLines[i];
+            const char* lineEnd = faceLines[i+1];
+            int numberOfIndices, first = 0, previous = 0, current = 0;
+            parseNumber(q, lineEnd, numberOfIndices);
+            bool valid = parseNumber(q, lineEnd, first) && parseNumber(q, lineEnd, previous);
+            valid = valid && first >= 0 && first < numberOfVertices && previous >= 0 && previous < numberOfVertices;
+            for (int t = 0; t < numberOfTriangles; t++) {
+                valid = valid && parseNumber(q, lineEnd, current) && current >= 0 && current < numberOfVertices;
+                indices[firstTriangle[i] + t] = Vec3<int>(first, previous, current);
+                previous = current;
+            }
+            if (!valid) {
+                std::fill_n(indices.begin() + firstTriangle[i], numberOfTriangles, Vec3<int>(-1, -1, -1));
+                badFaces++;
+            }
         }
+        if (badFaces > 0) {
+            std::cout << "      Malformed faces: " << badFaces << std::endl;
+            indices.erase(std::remove(indices.begin(), indices.end(), Vec3<int>(-1, -1, -1)), indices.end());
+        }
+        if ((int) indices.size() != numberOfFaces)
+            std::cout << "      #triangles: " << indices.size() << std::endl;
+    }
+
+    // Points the arrays returned by the getters to the vectors
+    void bindArrays() {
+        vertexArray = ArrayView<Vec3<float>>(vertices);
+        vertexNormalArray = ArrayView<Vec3<float>>(vertexNormals);
+        indexArray = ArrayView<Vec3<int>>(indices);
+        faceNormalArray = ArrayView<Vec3<float>>(faceNormals);
+    }
+
+    /*
+    * Binary mesh cache: the header, then the vertices, indices, face normals and
+    * vertex normals as little-endian arrays aligned to 64 bytes. The file is
+    * mapped and the arrays are used in place, without being copied.
+    */
+    struct MeshCacheHeader {
+        char magic[4];
+        uint32_t version;
+        uint64_t sourceSize;        // size and modification time of the source file
+        int64_t sourceTime;
+        uint64_t sourceHash;        // checked only when the modification time changed
+        uint64_t numberOfVertices;
+        uint64_t numberOfTriangles;
+        float bounds[6];
+        uint64_t offsets[4];        // vertices, indices, face normals, vertex normals
+    };
+
+    static constexpr char meshCacheMagic[4] = {'M', 'E', 'S', 'H'};
+    static constexpr uint32_t meshCacheVersion = 1;
+
+    static bool isLittleEndian() {
+        uint16_t one = 1;
+        return *reinterpret_cast<const unsigned char*>(&one) == 1;
+    }
+
+    static uint64_t alignOffset(uint64_t offset) {
+        return (offset + 63) & ~(uint64_t) 63;
+    }
+
+    static int64_t modificationTime(const std::string& filename) {
+        std::error_code error;
+        auto time = std::filesystem::last_write_time(filename, error);
+        return error ? 0 : (int64_t) time.time_since_epoch().count();
+    }
+
+    // Maps the cache when it matches the source, returns false when it must be rebuilt
+    bool loadMeshCache(const std::string& filename, const MappedFile& source, int64_t sourceTime) {
+        static_assert(sizeof(Vec3<float>) == 3 * sizeof(float) && sizeof(Vec3<int>) == 3 * sizeof(int),
+                      "the arrays of the cache are used as arrays of Vec3");
+        if (!isLittleEndian())
+            return false;
+
+        auto file = std::make_unique<MappedFile>(filename, true);
+        MeshCacheHeader header;
+        if (!file->isOpen() || file->size() < sizeof(header))
+            return false;
+        std::memcpy(&header, file->data(), sizeof(header));
+        if (!std::equal(header.magic, header.magic + sizeof(header.magic), meshCacheMagic)
+                || header.version != meshCacheVersion || header.sourceSize != source.size())
+            return false;
+
+        // Same contents with another time, after a copy or a checkout: the stamp is refreshed below
+        bool touched = header.sourceTime != sourceTime;
+        if (touched && header.sourceHash != hashBytes(source.data(), source.size()))
+            return false;
+
+        uint64_t counts[4] = {header.numberOfVertices, header.numberOfTriangles, header.numberOfTriangles, header.numberOfVertices};
+        for (int i = 0; i < 4; i++) {
+            if (header.offsets[i] % 64 != 0 || header.offsets[i] > file->size()
+                    || counts[i] > (file->size() - header.offsets[i]) / sizeof(Vec3<float>))
+                return false;
+        }
+
+        char* data = file->data();
+        vertexArray = ArrayView<Vec3<float>>(reinterpret_cast<Vec3<float>*>(data + header.offsets[0]), header.numberOfVertices);
+        indexArray = ArrayView<Vec3<int>>(reinterpret_cast<Vec3<int>*>(data + header.offsets[1]), header.numberOfTriangles);
+        faceNormalArray = ArrayView<Vec3<float>>(reinterpret_cast<Vec3<float>*>(data + header.offsets[2]), header.numberOfTriangles);
+        vertexNormalArray = ArrayView<Vec3<float>>(reinterpret_cast<Vec3<float>*>(data + header.offsets[3]), header.numberOfVertices);
+        aabb = AABB(Vec3<float>(header.bounds[0], header.bounds[1], header.bounds[2]),
+                    Vec3<float>(header.bounds[3], header.bounds[4], header.bounds[5]));
+        meshCache = std::move(file);
+
+        std::cout << "Model.h" << std::endl;
+        std::cout << "      Loading mesh cache: " << filename << std::endl;
+        std::cout << "      #vertices: " << vertexArray.size() << std::endl;
+        std::cout << "      #triangles: " << indexArray.size() << std::endl;
+        if (touched)
+            saveMeshCache(filename, header.sourceSize, sourceTime, header.sourceHash);
+        return true;
+    }
+
+    // Written to a temporary file then renamed, a mapped cache is never modified
+    void saveMeshCache(const std::string& filename, uint64_t sourceSize, int64_t sourceTime, uint64_t sourceHash) const {
+        if (!isLittleEndian())
+            return;
+
+        MeshCacheHeader header = {};
+        std::copy(meshCacheMagic, meshCacheMagic + sizeof(meshCacheMagic), header.magic);
+        header.version = meshCacheVersion;
+        header.sourceSize = sourceSize;
+        header.sourceTime = sourceTime;
+        header.sourceHash = sourceHash;
+        header.numberOfVertices = vertexArray.size();
+        header.numberOfTriangles = indexArray.size();
+        for (int i = 0; i < 3; i++) {
+            header.bounds[i] = aabb.getMinBound()[i];
+            header.bounds[3 + i] = aabb.getMaxBound()[i];
+        }
+
+        const void* arrays[4] = {vertexArray.data(), indexArray.data(), faceNormalArray.data(), vertexNormalArray.data()};
+        uint64_t sizes[4] = {vertexArray.size() * sizeof(Vec3<float>), indexArray.size() * sizeof(Vec3<int>),
+                             faceNormalArray.size() * sizeof(Vec3<float>), vertexNormalArray.size() * sizeof(Vec3<float>)};
+        uint64_t offset = alignOffset(sizeof(header));
+        for (int i = 0; i < 4; i++) {
+            header.offsets[i] = offset;
+            offset = alignOffset(offset + sizes[i]);
+        }
+
+        std::string temporary = filename + ".tmp";
+        std::ofstream file(temporary, std::ios::binary);
+        if (!file)
+            return;
+
+        const char padding[64] = {};
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        uint64_t position = sizeof(header);
+        for (int i = 0; i < 4; i++) {
+            file.write(padding, header.offsets[i] - position);
+            file.write(static_cast<const char*>(arrays[i]), sizes[i]);
+            position = header.offsets[i] + sizes[i];
+        }
+        file.close();
+
+        if (!file || std::rename(temporary.c_str(), filename.c_str()) != 0) {
+            std::remove(temporary.c_str());
+            return;
+        }
+        std::cout << "      Saved mesh cache:   " << filename << std::endl;
     }
 
     void computeCentroid() {
@@ -183,6 +471,14 @@ private:
     Vec3<float> centroid;
     Material material;
     AABB aabb;
+
+    // Arrays returned by the getters, over the vectors above or the mapped mesh cache
+    ArrayView<Vec3<float>> vertexArray;
+    ArrayView<Vec3<float>> vertexNormalArray;
+    ArrayView<Vec3<int>> indexArray;
+    ArrayView<Vec3<float>> faceNormalArray;
+    std::unique_ptr<MappedFile> meshCache;
+    uint64_t version = nextVersion();
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,80 @@
+#ifndef PATH_STATES_H
+#define PATH_STATES_H
+
+#include <vector>
+#include "Vec3.h"
+#include "Ray.h"
+#include "Random.h"
+
+/*
+* Paths traced by the wavefront integrator, stored as structure of arrays so
+* that each stage only walks through the arrays it needs. Paths never move:
+* the stages go through the indices of the paths still alive.
+*/
+struct PathStates {
+    // Shadow ray from the hit of a path towards a point on a light
+    struct Connection {
+        Vec3<float> origin;
+        Vec3<float> direction;
+        float distance;             // < 0 for an unused connection
+        bool test;                  // false when shadows are disabled
+        Vec3<float> contribution;   // weighted by the throughput of the path
+        Vec3<float> direct;         // direct lighting learnt by the Q-table
+    };
+
+    void resize(int count, int connections) {
+        connectionsPerPath = connections;
+        pixel.resize(count);
+        origin.resize(count);
+        direction.resize(count);
+        throughput.resize(count);
+        radiance.resize(count);
+        hitShading.resize(count);
+        hit.resize(count);
+        depth.resize(count);
+        directionPdf.resize(count);
+        qOrigin.resize(count);
+        sampleIndex.resize(count);
+        rng.resize(count);
+        cameraHit.resize(count);
+        alive.resize(count);
+        this->connections.resize((std::size_t) count * connections);
+    }
+
+    // Camera ray through the pixel
+    void start(int p, int pixelIndex, const Ray& ray, const Random& generator) {
+        pixel[p] = pixelIndex;
+        origin[p] = ray.getOrigin();
+        direction[p] = ray.getDirection();
+        throughput[p] = Vec3<float>(1.f, 1.f, 1.f);
+        radiance[p] = Vec3<float>(0.f, 0.f, 0.f);
+        depth[p] = 0;
+        directionPdf[p] = 0.f;
+        qOrigin[p] = -1;
+        sampleIndex[p] = -1;
+        rng[p] = generator;
+        cameraHit[p] = false;
+        alive[p] = true;
+    }
+
+    Connection* getConnections(int p) { return &connections[(std::size_t) p * connectionsPerPath]; }
+
+    std::vector<int> pixel;
+    std::vector<Vec3<float>> origin;
+    std::vector<Vec3<float>> direction;
+    std::vector<Vec3<float>> throughput;
+    std::vector<Vec3<float>> radiance;      // light gathered so far
+    std::vector<Vec3<float>> hitShading;    // light leaving the last hit, for the Q-table
+    std::vector<Ray::Hit> hit;
+    std::vector<int> depth;
+    std::vector<float> directionPdf;        // density of the direction of the last bounce
+    std::vector<int> qOrigin;               // Q-table state (leaf id) of the last bounce
+    std::vector<int> sampleIndex;
+    std::vector<Random> rng;
+    std::vector<char> cameraHit;            // the camera ray hit something
+    std::vector<char> alive;
+    std::vector<Connection> connections;    // connectionsPerPath for each path
+    int connectionsPerPath;
+};
+
+#endif
@@ -1,47 +1,167 @@
+#include <vector>
 #include <map>
+#include <string>
+#include <fstream>
+#include "SIMD.h"
+#include "Model.h"
 #include "HemisphereSampling.h"
 #include "BVH.h"
 #include "HemisphereMapping.h"
 #include "Material.h"
 
+/*
+* One hemisphere of Q values per leaf of the BVH, allocated up front and indexed
+* by the id of the leaf, so that threads share the table without locks: the
+* values themselves are updated atomically.
+*/
 class Qtable {
 public:
-    Qtable(int resX, int resY, float lr) : resX(resX), resY(resY), lr(lr) {}
+    // Leaf -1 is the state of the hits found without a BVH, it is never updated.
+    // The BRDF of the materials of the models is tabulated for the updates.
+    Qtable(const std::vector<Model*>& models, int numberOfLeaves, int resX, int resY, float lr)
+            : table(numberOfLeaves + 1, HemisphereMapping(resX, resY)),
+              resX(resX), resY(resY), lr(lr) {
+        for (const Model* model: models)
+            addMaterial(model->getMaterial());
+    }
+
+    // Tabulates the BRDF of a material that is not the one of a model, not safe with other threads
+    void addMaterial(const Material& material) {
+        if (brdfTables.find(&material) == brdfTables.end())
+            brdfTables[&material] = computeBRDFTable(material);
+    }
 
-    HemisphereSampling* getHemisphereSampler(const BVH::Node* n) {
-        auto ret = table.insert({n, HemisphereMapping(resX, resY)});
-        auto& it = ret.first;
-        return &it->second;
+    HemisphereSampling* getHemisphereSampler(int leaf) {
+        return &table[leaf + 1];
     }
 
-    void sampleDirection(const BVH::Node* n, HemisphereMapping::Sample& s) {
-        auto ret = table.insert({n, HemisphereMapping(resX, resY)});
-        auto& it = ret.first;
-        it->second.sampleDirection(s);
+    void sampleDirection(int leaf, HemisphereMapping::Sample& s, Random& rng) const {
+        table[leaf + 1].sampleDirection(s, rng);
     }
 
-    void update(const BVH::Node* nOrigin, const BVH::Node* nHit, int wIndex,
-                const Vec3<float>& irradiance, const Material& material) {
-        auto& hemisphereMapping = table.at(nOrigin);
-        auto q = hemisphereMapping.getValue(wIndex);
-        auto w = hemisphereMapping.getDir(wIndex);
+    float probability(int leaf, const Vec3<float>& direction) const {
+        return table[leaf + 1].probability(direction);
+    }
+
+    void update(int leafOrigin, int leafHit, int wIndex,
+                const Vec3<float>& irradiance, const Material& material, Random& rng) {
+        auto& hemisphereMapping = table[leafOrigin + 1];
 
-        // x = nOrigin, y = nHit
+        // x = leafOrigin, y = leafHit
         // Q'(x, w) = (1 - lr) * Q(x, w)
         //            + lr * (Le(y, -w) + [max/integral]fs(wi, w) * cosThetaI * Q(y, wi))
-        float qUpdated = (1.f - lr) * q
-                               + lr * (irradiance.length() + approxIntegral(nHit, w, material));
+        float integral;
+        auto brdfTable = brdfTables.find(&material);
+        if (brdfTable != brdfTables.end()) {
+            integral = tabulatedIntegral(leafHit, &brdfTable->second[wIndex * hemisphereMapping.size()]);
+        } else {
+            auto w = hemisphereMapping.getDir(wIndex, rng);
+            integral = approxIntegral(leafHit, w, material, rng);
+        }
+        hemisphereMapping.updateByIndex(wIndex, irradiance.length() + integral, lr);
+    }
+
+    std::size_t size() const { return table.size(); }
+
+    const HemisphereMapping& getMapping(int leaf) const { return table[leaf + 1]; }
+
+    // Binary snapshot of the table: a header with the hash of the scene, then the
+    // key of each leaf of the BVH followed by its values
+    bool save(const std::string& filename, const BVH& bvh, uint64_t sceneHash) const {
+        std::ofstream file(filename, std::ios::binary);
+        if (!file)
+            return false;
+
+        const auto& nodes = bvh.getNodes();
+        int size = resX * resY;
+        uint32_t numberOfLeaves = bvh.getNumberOfLeaves();
+        file.write(snapshotMagic, sizeof(snapshotMagic));
+        file.write(reinterpret_cast<const char*>(&sceneHash), sizeof(sceneHash));
+        file.write(reinterpret_cast<const char*>(&resX), sizeof(resX));
+        file.write(reinterpret_cast<const char*>(&resY), sizeof(resY));
+        file.write(reinterpret_cast<const char*>(&numberOfLeaves), sizeof(numberOfLeaves));
+
+        std::vector<float> values(size);
+        for (const BVH::LinearNode& node: nodes) {
+            if (!node.isLeaf())
+                continue;
+
+            uint64_t key = bvh.leafKey(node);
+            const auto& mapping = getMapping(bvh.getLeafId(&node));
+            for (int i = 0; i < size; i++)
+                values[i] = mapping.getValue(i);
+            file.write(reinterpret_cast<const char*>(&key), sizeof(key));
+            file.write(reinterpret_cast<const char*>(values.data()), size * sizeof(float));
+        }
+
+        std::cout << "Qtable.h" << std::endl;
+        std::cout << "      Saved snapshot:     " << filename << " (" << numberOfLeaves << " leaves)" << std::endl;
+        return (bool) file;
+    }
+
+    // Restores the leaves of the snapshot whose key matches a leaf of the BVH, the
+    // others keep their uniform values. Returns the number of leaves restored. The key
+    // covers the triangles of the leaf: when the scene hash differs from the one of the
+    // snapshot, only the leaves whose geometry is unchanged are restored, and a leaf of
+    // another scene never is, even with the same bounds and number of triangles.
+    int load(const std::string& filename, const BVH& bvh, uint64_t sceneHash) {
+        std::ifstream file(filename, std::ios::binary);
+        if (!file)
+            return 0;
+
+        char magic[sizeof(snapshotMagic)];
+        uint64_t snapshotHash;
+        int snapshotResX, snapshotResY;
+        uint32_t numberOfLeaves;
+        file.read(magic, sizeof(magic));
+        file.read(reinterpret_cast<char*>(&snapshotHash), sizeof(snapshotHash));
+        file.read(reinterpret_cast<char*>(&snapshotResX), sizeof(snapshotResX));
+        file.read(reinterpret_cast<char*>(&snapshotResY), sizeof(snapshotResY));
+        file.read(reinterpret_cast<char*>(&numberOfLeaves), sizeof(numberOfLeaves));
+
+        std::cout << "Qtable.h" << std::endl;
+        if (!file || !std::equal(magic, magic + sizeof(magic), snapshotMagic)
+                || snapshotResX != resX || snapshotResY != resY) {
+            std::cout << "      Snapshot ignored:   " << filename << " (not a Q-table of this resolution)" << std::endl;
+            return 0;
+        }
+
+        int size = resX * resY;
+        std::map<uint64_t, std::vector<float>> snapshot;
+        for (uint32_t l = 0; l < numberOfLeaves; l++) {
+            uint64_t key;
+            std::vector<float> values(size);
+            file.read(reinterpret_cast<char*>(&key), sizeof(key));
+            file.read(reinterpret_cast<char*>(values.data()), size * sizeof(float));
+            if (!file)
+                break;
+            snapshot.emplace(key, std::move(values));
+        }
+
+        int restored = 0;
+        for (const BVH::LinearNode& node: bvh.getNodes()) {
+            if (!node.isLeaf())
+                continue;
+
+            auto entry = snapshot.find(bvh.leafKey(node));
+            if (entry != snapshot.end()) {
+                table[bvh.getLeafId(&node) + 1].setValues(entry->second.data());
+                restored++;
+            }
+        }
 
-        hemisphereMapping.updateByIndex(wIndex, qUpdated);
+        std::cout << "      Loaded snapshot:    " << filename << " (" << restored << " / "
+                  << bvh.getNumberOfLeaves() << " leaves"
+                  << (snapshotHash == sceneHash ? ", same scene)" : ", modified scene)") << std::endl;
+        return restored;
     }
 
 private:
-    float maxValue(const BVH::Node* y,
-                         const Vec3<float>& w,
-                         const Material& material) {
-        auto ret = table.insert({y, HemisphereMapping(resX, resY)});
-        auto& mapping = ret.first->second;
- 
+    float maxValue(int y,
+                   const Vec3<float>& w,
+                   const Material& material) const {
+        const auto& mapping = table[y + 1];
+
         auto Qy = mapping.getValue(0);
         for (int i = 0; i < (int) mapping.size(); i++) {
             auto currentQy = mapping.getValue(i);
@@ -53,17 +173,17 @@ private:
         return Qy;
     }
 
-    float approxIntegral(const BVH::Node* y,
-                                 const Vec3<float>& w,
-                                 const Material& material) {
-        auto ret = table.insert({y, HemisphereMapping(resX, resY)});
-        auto& mapping = ret.first->second;
- 
+    float approxIntegral(int y,
+                         const Vec3<float>& w,
+                         const Material& material,
+                         Random& rng) const {
+        const auto& mapping = table[y + 1];
+
         float sum = 0.f;
         Vec3<float> normal(0.f, 0.f, 1.f);
         for (int i = 0; i < (int) mapping.size(); i++) {
             auto Qy = mapping.getValue(i);
-            Vec3<float> wi = mapping.getDir(i);
+            Vec3<float> wi = mapping.getDir(i, rng);
             float cosAngle = std::max(dot(wi, normal), 0.f);
             Vec3<float> fs = material.evaluateBRDF(normal, wi, w);
             sum += fs.length() * Qy * cosAngle;
@@ -73,9 +193,68 @@ private:
         return sum / (float) mapping.size();
     }
 
-    // Node -> hemisphere
+    // Row w of the table of a material: fs(wi, w).length() * cosThetaI / size for each
+    // cell wi, averaged over a grid of tableShifts x tableShifts directions in both cells
+    std::vector<float> computeBRDFTable(const Material& material) const {
+        HemisphereMapping mapping(resX, resY);
+        int size = mapping.size();
+        int shifts = tableShifts * tableShifts;
+        std::vector<Vec3<float>> directions((std::size_t) size * shifts);
+        for (int i = 0; i < size; i++)
+            for (int k = 0; k < shifts; k++)
+                directions[i * shifts + k] = mapping.getDir(i, (k % tableShifts + 0.5f) / tableShifts,
+                                                            (k / tableShifts + 0.5f) / tableShifts);
+
+        std::vector<float> brdfTable((std::size_t) size * size, 0.f);
+        Vec3<float> normal(0.f, 0.f, 1.f);
+        for (int w = 0; w < size; w++) {
+            for (int i = 0; i < size; i++) {
+                float sum = 0.f;
+                for (int k = 0; k < shifts; k++) {
+                    const Vec3<float>& wi = directions[i * shifts + k];
+                    float cosAngle = std::max(dot(wi, normal), 0.f);
+                    for (int l = 0; l < shifts; l++)
+                        sum += material.evaluateBRDF(normal, wi, directions[w * shifts + l]).length() * cosAngle;
+                }
+                brdfTable[(std::size_t) w * size + i] = sum / (shifts * shifts * size);
+            }
+        }
+        return brdfTable;
+    }
+
+    // approxIntegral() as the dot product of the Q values of y with a row of a BRDF table
+    float tabulatedIntegral(int y, const float* brdfRow) const {
+        using namespace simd;
+        const auto& mapping = table[y + 1];
+        int size = mapping.size();
+
+        alignas(32) float q[SIMD_WIDTH];
+        vfloat sum(0.f);
+        int i = 0;
+        for (; i + SIMD_WIDTH <= size; i += SIMD_WIDTH) {
+            for (int k = 0; k < SIMD_WIDTH; k++)
+                q[k] = mapping.getValue(i + k);
+            sum += vfloat::load(q) * vfloat::loadu(brdfRow + i);
+        }
+
+        alignas(32) float lanes[SIMD_WIDTH];
+        sum.store(lanes);
+        float result = 0.f;
+        for (int k = 0; k < SIMD_WIDTH; k++)
+            result += lanes[k];
+        for (; i < size; i++)
+            result += mapping.getValue(i) * brdfRow[i];
+        return result;
+    }
+
+    static constexpr int tableShifts = 2;
+    static constexpr char snapshotMagic[4] = {'Q', 'T', 'B', '2'};  // 2: keys hash the triangles
+
+    // Leaf id + 1 -> hemisphere
     // x in R^3 -> score (probability) for each direction from x
-    std::map<const BVH::Node*, HemisphereMapping> table;
+    std::vector<HemisphereMapping> table;
+    // Material -> BRDF table, rows indexed by the cell of the outgoing direction
+    std::map<const Material*, std::vector<float>> brdfTables;
     int resX;
     int resY;
     float lr;   // learning rate
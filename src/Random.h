@@ -0,0 +1,49 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <cstdint>
+
+/*
+* PCG32 random number generator
+* source: https://www.pcg-random.org/download.html
+*
+* Every pixel owns its own generator, seeded from the pixel index, so
+* renders don't depend on the number of threads or on the order of the
+* tiles, and threads don't serialize on the global rand() lock.
+*/
+class Random {
+public:
+    Random(uint64_t seed = 0, uint64_t stream = 0): state(0), inc((stream << 1u) | 1u) {
+        nextUInt();
+        // Mix the seed so neighbouring streams don't start from correlated states
+        state += mix(seed ^ mix(stream));
+        nextUInt();
+    }
+
+    uint32_t nextUInt() {
+        uint64_t old = state;
+        state = old * 6364136223846793005ULL + inc;
+        uint32_t xorShifted = (uint32_t) (((old >> 18u) ^ old) >> 27u);
+        uint32_t rot = (uint32_t) (old >> 59u);
+        return (xorShifted >> rot) | (xorShifted << ((-rot) & 31));
+    }
+
+    // Float in [0, 1)
+    float nextFloat() {
+        return (nextUInt() >> 8) * (1.f / 16777216.f);
+    }
+
+private:
+    // splitmix64 finalizer
+    static uint64_t mix(uint64_t x) {
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    uint64_t state;
+    uint64_t inc;
+};
+
+#endif
\ No newline at end of file
@@ -2,8 +2,12 @@
 #define RAY_H
 
 #include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
 #include "Vec3.h"
 #include "Model.h"
+#include "Instance.h"
 #include "AreaLight.h"
 
 class Ray {
@@ -11,7 +15,7 @@ public:
     class Hit {
         public:
         Hit() : index(-1), distance(0), b0(0), b1(0), b2(0),
-                m(nullptr), l(nullptr), info(nullptr) {}
+                m(nullptr), instance(nullptr), l(nullptr), info(nullptr) {}
         int index;                      // index of the corresponding triangle
         float distance;                 // distance of the hit
         Vec3<float> faceNormal;         // face normal of the corresponding triangle
@@ -23,31 +27,94 @@ public:
         float b2;
 
         const Model* m;
+        const Instance* instance;       // instance of the mesh m, nullptr for a model of the scene
         const AreaLight* l;
 
         // extra info
-        void* info;
+        const void* info;
+
+        const Material& getMaterial() const {
+            return instance ? instance->getMaterial() : m->getMaterial();
+        }
+
+        // Vertex k of the triangle hit, in world space
+        Vec3<float> getVertex(int k) const {
+            const Vec3<float>& v = m->getVertices()[m->getIndices()[index][k]];
+            return instance ? instance->getTransform().applyToPoint(v) : v;
+        }
     };
 
-    Ray(const Vec3<float>& origin, const Vec3<float>& direction,
-        const Model* m = nullptr, int index = -1): origin(origin),
-                                                   direction(direction),
-                                                   epsilon(0.00001f),
-                                                   originModel(m),
-                                                   originTriangleIndex(index) {}
+    Ray(const Vec3<float>& origin, const Vec3<float>& direction): origin(origin),
+                                                                  direction(direction),
+                                                                  invDirection(1.f / direction[0], 1.f / direction[1], 1.f / direction[2]),
+                                                                  epsilon(0.00001f),
+                                                                  determinantEpsilon(0.00001f),
+                                                                  tMin(0.f),
+                                                                  tMax(std::numeric_limits<float>::max()) {
+        for (int i = 0; i < 3; i++)
+            sign[i] = invDirection[i] < 0.f;
+    }
+
+    // Ray leaving the surface at position, whose geometric normal is faceNormal. The
+    // origin is pushed off the surface on the side of the direction, so the ray can't
+    // hit the triangle it starts from.
+    static Ray spawn(const Vec3<float>& position, const Vec3<float>& faceNormal, const Vec3<float>& direction) {
+        Vec3<float> n = dot(faceNormal, direction) < 0.f ? -faceNormal : faceNormal;
+        return Ray(offsetOrigin(position, n), direction);
+    }
+
+    // Moves p along n by a few ulps, scaled with the magnitude of p, or by a small
+    // fixed distance close to 0 where ulps are too small
+    // source: Wächter and Binder, A Fast and Robust Method for Avoiding Self-Intersection, Ray Tracing Gems
+    static Vec3<float> offsetOrigin(const Vec3<float>& p, const Vec3<float>& n) {
+        constexpr float originThreshold = 1.f / 32.f;
+        constexpr float floatScale = 1.f / 65536.f;
+        constexpr float intScale = 256.f;
+
+        Vec3<float> offset;
+        for (int i = 0; i < 3; i++) {
+            int32_t ulps = (int32_t) (intScale * n[i]);
+            int32_t bits;
+            std::memcpy(&bits, &p[i], sizeof(float));
+            bits += p[i] < 0.f ? -ulps : ulps;
+            float moved;
+            std::memcpy(&moved, &bits, sizeof(float));
+            offset[i] = std::abs(p[i]) < originThreshold ? p[i] + floatScale * n[i] : moved;
+        }
+        return offset;
+    }
 
     const Vec3<float>& getOrigin() const { return origin; }
     const Vec3<float>& getDirection() const { return direction; }
+    const Vec3<float>& getInvDirection() const { return invDirection; }
+    // 1 when the direction is negative along the axis
+    int getSign(int axis) const { return sign[axis]; }
+    float getEpsilon() const { return epsilon; }
+    // Smallest |determinant| of a triangle test, the triple product of the edges and
+    // the direction: below it the ray is taken as parallel to the triangle
+    float getDeterminantEpsilon() const { return determinantEpsilon; }
+    void setDeterminantEpsilon(float e) { determinantEpsilon = e; }
+    // Permutation of the axes and shear to the ray space of the watertight test,
+    // computed the first time the ray meets the watertight test
+    int getKx() const { computeWatertightSpace(); return kx; }
+    int getKy() const { computeWatertightSpace(); return ky; }
+    int getKz() const { computeWatertightSpace(); return kz; }
+    const Vec3<float>& getShear() const { computeWatertightSpace(); return shear; }
+
+    // Interval of distances searched along the ray, the closest hit queries
+    // of the BVH shrink tMax down to the hit found so far
+    float getTMin() const { return tMin; }
+    float getTMax() const { return tMax; }
+    void setTMax(float t) const { tMax = t; }
 
     bool intersectTriangle(const Vec3f &p0,
                             const Vec3f &p1,
                             const Vec3f &p2,
-                            const Vec3<float>& n,
                             Hit& hit) const {
         Vec3f edge1 = p1 - p0, edge2 = p2 - p0;
         Vec3f pvec = cross(direction, edge2);
         float det = dot(edge1, pvec);
-        if (fabs (det) < epsilon)
+        if (fabs (det) < determinantEpsilon)
             return false;
         float inv_det = 1.0f / det;
         Vec3f tvec = origin - p0;
@@ -63,29 +130,57 @@ public:
         return false;
     }
 
-    bool intersectAABB(const AABB& aabb) const {
-        Vec3<float> tMin = (aabb.getMinBound() - origin) / direction;
-        Vec3<float> tMax = (aabb.getMaxBound() - origin) / direction;
-
-        // swap if needed
-        for (int i = 0; i < 3; i++) {
-            if (tMin[i] > tMax[i])
-                std::swap(tMin[i], tMax[i]);
-        }
-
-        float tFirstPoint = (tMin[0] > tMin[1]) ? tMin[0] : tMin[1];
-        float tSecondPoint = (tMax[0] < tMax[1]) ? tMax[0] : tMax[1];
-
-        if (tFirstPoint > tMax[2] || tMin[2] > tSecondPoint)
+    // Any intersection with the triangle within [epsilon, tMax], without barycentric
+    // coordinates: it exits as soon as the ray is known to miss
+    bool occludedByTriangle(const Vec3f &p0,
+                            const Vec3f &p1,
+                            const Vec3f &p2,
+                            float tMax) const {
+        Vec3f edge1 = p1 - p0, edge2 = p2 - p0;
+        Vec3f pvec = cross(direction, edge2);
+        float det = dot(edge1, pvec);
+        if (fabs (det) < determinantEpsilon)
+            return false;
+        float inv_det = 1.0f / det;
+        Vec3f tvec = origin - p0;
+        float u = dot(tvec, pvec) * inv_det;
+        if (u < 0.f || u > 1.f)
             return false;
+        Vec3f qvec = cross(tvec, edge1);
+        float v = dot(direction, qvec) * inv_det;
+        if (v < 0.f || u + v > 1.f)
+            return false;
+        float t = dot(edge2, qvec) * inv_det;
+        return t >= epsilon && t <= tMax;
+    }
 
-        if (tMin[2] > tFirstPoint) tFirstPoint = tMin[2];
-        if (tMax[2] < tSecondPoint) tSecondPoint = tMax[2];
+    bool intersectAABB(const AABB& aabb) const {
+        float tEntry;
+        return intersectAABB(aabb, tMax, tEntry);
+    }
 
-        // hit.dPoint1 = tFirstPoint;
-        // hit.dPoint2 = tSecondPoint;
+    bool intersectAABB(const AABB& aabb, float& tEntry) const {
+        return intersectAABB(aabb, tMax, tEntry);
+    }
 
-        return true;
+    // Intersection with the box within [tMin, maxDistance], tEntry is the distance at
+    // which the ray enters it. The sign of the direction picks the near and far
+    // planes of each slab, so there is nothing to swap.
+    // A ray parallel to a slab whose origin lies on one of its planes gives 0 * inf =
+    // NaN for that plane: the ray lies in the face, so the plane is ignored. std::max
+    // and std::min return their first argument when the second is NaN, the interval
+    // therefore comes first. The SIMD tests of RayPacket and BVH follow the same rule.
+    bool intersectAABB(const AABB& aabb, float maxDistance, float& tEntry) const {
+        float tx0 = (aabb[sign[0]][0] - origin[0]) * invDirection[0];
+        float tx1 = (aabb[1 - sign[0]][0] - origin[0]) * invDirection[0];
+        float ty0 = (aabb[sign[1]][1] - origin[1]) * invDirection[1];
+        float ty1 = (aabb[1 - sign[1]][1] - origin[1]) * invDirection[1];
+        float tz0 = (aabb[sign[2]][2] - origin[2]) * invDirection[2];
+        float tz1 = (aabb[1 - sign[2]][2] - origin[2]) * invDirection[2];
+
+        tEntry = std::max(std::max(std::max(tMin, tx0), ty0), tz0);
+        float tExit = std::min(std::min(std::min(maxDistance, tx1), ty1), tz1);
+        return tEntry <= tExit;
     }
 
     bool intersectAreaLight(const AreaLight& light, Hit& hit) const {
@@ -109,12 +204,49 @@ public:
         return isPointInArea;
     }
 
-    bool intersect(const Model& model, Hit& hit, const std::vector<int>& relevantIndices = std::vector<int>()) const {
+    // Intersect the triangle of the model at the given index, the interpolated
+    // normal is left to computeInterpolatedNormal() once the closest hit is known
+    bool intersect(const Model& model, int index, Hit& hit) const {
         const auto& vertices = model.getVertices();
-        const auto& indices = model.getIndices();
-        const auto& faceNormals = model.getFaceNormals();
-        const auto& vertexNormals = model.getVertexNormals();
+        const Vec3<int>& triangle = model.getIndices()[index];
+
+        if (!intersectTriangle(vertices[triangle[0]], vertices[triangle[1]], vertices[triangle[2]], hit))
+            return false;
+
+        hit.index = index;
+        hit.faceNormal = model.getFaceNormals()[index];
+        hit.m = &model;
+        hit.instance = nullptr;
+        return true;
+    }
+
+    bool occluded(const Model& model, int index, float tMax) const {
+        const auto& vertices = model.getVertices();
+        const Vec3<int>& triangle = model.getIndices()[index];
+        return occludedByTriangle(vertices[triangle[0]], vertices[triangle[1]], vertices[triangle[2]], tMax);
+    }
+
+    bool occluded(const Model& model, float tMax) const {
+        float tEntry;
+        if (!intersectAABB(model.getAABB(), tMax, tEntry))
+            return false;
+
+        for (std::size_t i = 0; i < model.getIndices().size(); i++)
+            if (occluded(model, i, tMax))
+                return true;
 
+        return false;
+    }
+
+    static void computeInterpolatedNormal(Hit& hit) {
+        const auto& vertexNormals = hit.m->getVertexNormals();
+        const Vec3<int>& triangle = hit.m->getIndices()[hit.index];
+        hit.interpolatedNormal = normalize(hit.b0*vertexNormals[triangle[0]]
+                                           + hit.b1*vertexNormals[triangle[1]]
+                                           + hit.b2*vertexNormals[triangle[2]]);
+    }
+
+    bool intersect(const Model& model, Hit& hit) const {
         // Check if there is an intersection with the AABB
         if (!intersectAABB(model.getAABB()))
             return false;
@@ -122,47 +254,48 @@ public:
         // Iterate through each triangle and check if there is an intersection
         bool intersected = false;
         Hit currentHit;
-
-        std::size_t j = 0;
-        for (std::size_t i = 0; i < indices.size() + j; i++) {
-            if (relevantIndices.size() > 0) {
-                if (j == relevantIndices.size())
-                    break;
-                else
-                    i = relevantIndices[j++];
-            }
-
-            const Vec3<int>& triangle = indices[i];
-            const Vec3<float>& n = faceNormals[i];
-
-            if (intersectTriangle(vertices[triangle[0]], vertices[triangle[1]], vertices[triangle[2]], n, currentHit)
-                    && (originModel != &model || originTriangleIndex != (int) i)
+        for (std::size_t i = 0; i < model.getIndices().size(); i++) {
+            if (intersect(model, i, currentHit)
                     && (!intersected || currentHit.distance < hit.distance)) {
                 hit = currentHit;
-                hit.index = i;
-                hit.faceNormal = n;
-
                 intersected = true;
             }
         }
 
-        if (intersected) {
-            hit.interpolatedNormal = normalize(hit.b0*vertexNormals[indices[hit.index][0]]
-                                    + hit.b1*vertexNormals[indices[hit.index][1]]
-                                    + hit.b2*vertexNormals[indices[hit.index][2]]);
-            hit.m = &model;
-        }
+        if (intersected)
+            computeInterpolatedNormal(hit);
 
         return intersected;
     }
 
 private:
+    // Ray space of the watertight test: kz is the dominant axis of the direction,
+    // kx and ky are swapped to keep the winding of the triangles
+    void computeWatertightSpace() const {
+        if (hasWatertightSpace)
+            return;
+
+        kz = std::abs(direction[0]) > std::abs(direction[1]) ? 0 : 1;
+        kz = std::abs(direction[kz]) > std::abs(direction[2]) ? kz : 2;
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        if (direction[kz] < 0.f)
+            std::swap(kx, ky);
+        shear = Vec3<float>(direction[kx] / direction[kz], direction[ky] / direction[kz], 1.f / direction[kz]);
+        hasWatertightSpace = true;
+    }
+
     Vec3<float> origin;     // Starting position of the ray
     Vec3<float> direction;  // Direction of the ray
+    Vec3<float> invDirection;
+    int sign[3];
+    mutable bool hasWatertightSpace = false;
+    mutable int kx = 0, ky = 0, kz = 2;
+    mutable Vec3<float> shear;
     float epsilon;
-
-    const Model* originModel;
-    int originTriangleIndex;
+    float determinantEpsilon;
+    float tMin;
+    mutable float tMax;
 };
 
 #endif
\ No newline at end of file
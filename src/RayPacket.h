@@ -0,0 +1,114 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include <limits>
+#include "SIMD.h"
+#include "Ray.h"
+
+/*
+* Up to SIMD_WIDTH rays traced together through the BVH, stored as structure
+* of arrays so that each node and triangle is tested against every lane at once.
+*/
+class RayPacket {
+public:
+    static constexpr int size = SIMD_WIDTH;
+
+    RayPacket(const Ray* rays, int count): rays(rays), count(count), coherent(true) {
+        for (int k = 0; k < size; k++) {
+            // Unused lanes repeat the first ray, their interval stays empty
+            const Ray& ray = rays[k < count ? k : 0];
+            const Vec3<float>& o = ray.getOrigin();
+            const Vec3<float>& d = ray.getDirection();
+            const Vec3<float>& inv = ray.getInvDirection();
+            ox[k] = o[0]; oy[k] = o[1]; oz[k] = o[2];
+            dx[k] = d[0]; dy[k] = d[1]; dz[k] = d[2];
+            invDx[k] = inv[0]; invDy[k] = inv[1]; invDz[k] = inv[2];
+            tMax[k] = k < count ? ray.getTMax() : -1.f;
+        }
+
+        // Every ray must visit the children in the same order
+        for (int axis = 0; axis < 3; axis++) {
+            dirIsNeg[axis] = rays[0].getSign(axis);
+            for (int k = 1; k < count; k++)
+                if (rays[k].getSign(axis) != dirIsNeg[axis])
+                    coherent = false;
+        }
+    }
+
+    const Ray& getRay(int k) const { return rays[k]; }
+    int getCount() const { return count; }
+    bool isCoherent() const { return coherent; }
+
+    // Lanes whose interval [0, tMax] overlaps the box, with the test of Ray::intersectAABB:
+    // the sign of each direction picks the near and far planes, and a NaN plane is
+    // ignored. SIMD min and max return their second operand when one is NaN, the
+    // interval therefore comes second.
+    int intersectAABB(const AABB& aabb) const {
+        using namespace simd;
+        vfloat bMin[3], bMax[3];
+        for (int axis = 0; axis < 3; axis++) {
+            bMin[axis] = vfloat(aabb.getMinBound()[axis]);
+            bMax[axis] = vfloat(aabb.getMaxBound()[axis]);
+        }
+        vfloat ix = vfloat::load(invDx), iy = vfloat::load(invDy), iz = vfloat::load(invDz);
+        vmask nx = ix < vfloat(0.f), ny = iy < vfloat(0.f), nz = iz < vfloat(0.f);
+        vfloat x0 = (select(nx, bMax[0], bMin[0]) - vfloat::load(ox)) * ix;
+        vfloat x1 = (select(nx, bMin[0], bMax[0]) - vfloat::load(ox)) * ix;
+        vfloat y0 = (select(ny, bMax[1], bMin[1]) - vfloat::load(oy)) * iy;
+        vfloat y1 = (select(ny, bMin[1], bMax[1]) - vfloat::load(oy)) * iy;
+        vfloat z0 = (select(nz, bMax[2], bMin[2]) - vfloat::load(oz)) * iz;
+        vfloat z1 = (select(nz, bMin[2], bMax[2]) - vfloat::load(oz)) * iz;
+
+        vfloat tEntry = max(z0, max(y0, max(x0, vfloat(0.f))));
+        vfloat tExit = min(z1, min(y1, min(x1, vfloat::load(tMax))));
+        return (tEntry <= tExit).bits();
+    }
+
+    // Möller–Trumbore against every lane for the triangle of first vertex p0 and
+    // edges e1, e2. Returns the lanes hitting it closer than their tMax along with
+    // the distances and barycentric coordinates.
+    int intersectTriangle(const Vec3<float>& p0, const Vec3<float>& e1, const Vec3<float>& e2,
+                          float* t, float* b1, float* b2) const {
+        using namespace simd;
+        vvec3 edge1(e1[0], e1[1], e1[2]), edge2(e2[0], e2[1], e2[2]);
+        vvec3 direction(vfloat::load(dx), vfloat::load(dy), vfloat::load(dz));
+        vvec3 origin(vfloat::load(ox), vfloat::load(oy), vfloat::load(oz));
+
+        vvec3 pvec = cross(direction, edge2);
+        vfloat det = dot(edge1, pvec);
+        vfloat invDet = vfloat(1.f) / det;
+        vvec3 tvec = origin - vvec3(p0[0], p0[1], p0[2]);
+        vfloat u = dot(tvec, pvec) * invDet;
+        vvec3 qvec = cross(tvec, edge1);
+        vfloat v = dot(direction, qvec) * invDet;
+        vfloat distance = dot(edge2, qvec) * invDet;
+
+        vmask mask = (abs(det) >= vfloat(epsilon))
+                     & (u >= vfloat(0.f)) & (u <= vfloat(1.f))
+                     & (v >= vfloat(0.f)) & (u + v <= vfloat(1.f))
+                     & (distance >= vfloat(0.f)) & (distance < vfloat::load(tMax));
+        int bits = mask.bits();
+        if (bits) {
+            distance.store(t);
+            u.store(b1);
+            v.store(b2);
+        }
+        return bits;
+    }
+
+    bool dirIsNeg[3];
+    alignas(32) float tMax[size];   // closest hit of each lane so far
+
+private:
+    static constexpr float epsilon = 0.00001f; // same as Ray
+
+    const Ray* rays;
+    int count;
+    bool coherent;  // all the directions lie in the same octant
+
+    alignas(32) float ox[size], oy[size], oz[size];
+    alignas(32) float dx[size], dy[size], dz[size];
+    alignas(32) float invDx[size], invDy[size], invDz[size];
+};
+
+#endif
\ No newline at end of file
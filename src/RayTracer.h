@@ -1,11 +1,17 @@
 #ifndef RAYTRACER_H
 #define RAYTRACER_H
 
+#include <stdexcept>
+#include <omp.h>
 #include "Image.h"
 #include "Scene.h"
 #include "Ray.h"
 #include "BVH.h"
+#include "InstanceBVH.h"
 #include "Qtable.h"
+#include "EmitterSampling.h"
+#include "AccumulationBuffer.h"
+#include "PathStates.h"
 
 class RayTracer {
 public:
@@ -15,9 +21,37 @@ public:
               antialiasing(antiAliasing),
               bvh(bvh),
               pathTracing(false),
+              purePathTracing(false),
+              russianRoulette(false),
+              nextEventEstimation(false),
+              progressive(false),
+              adaptive(false),
               cosineWeighted(false),
               learningLT(false),
-              aaRes(antiAliasingRes) {}
+              rayPackets(false),
+              watertight(false),
+              wavefront(false),
+              aaRes(antiAliasingRes),
+              numberOfThreads(0),
+              tileSize(16),
+              seed(0),
+              pBvh(nullptr),
+              bvhMinSplit(100),
+              bvhSplitMethod(BVH::SplitMethod::Middle),
+              bvhWide(false),
+              bvhRebuildThreshold(0.f),
+              bvhUpdateTime(0.),
+              pInstanceBvh(nullptr),
+              pHemisphereSampling(nullptr),
+              qtable(nullptr) {}
+
+    ~RayTracer() {
+        delete pHemisphereSampling;
+        delete qtable;
+    }
+
+    RayTracer(const RayTracer&) = delete;
+    RayTracer& operator=(const RayTracer&) = delete;
 
     void enableShadow() {
         shadow = true;
@@ -26,9 +60,23 @@ public:
         antialiasing = true;
         aaRes = res;
     }
-    void enableBVH(int minSplit=100) {
+    // wide: trace through a 4-wide (SSE) or 8-wide (AVX2) BVH collapsed from the binary one
+    void enableBVH(int minSplit=100, BVH::SplitMethod splitMethod=BVH::SplitMethod::Middle, bool wide=false) {
         bvh = true;
         bvhMinSplit = minSplit;
+        bvhSplitMethod = splitMethod;
+        bvhWide = wide;
+    }
+
+    // Watertight ray/triangle test in the BVH: no ray leaks through shared edges
+    void enableWatertight() {
+        watertight = true;
+    }
+    // Between two renders of the same scene, the BVH of moved models is refitted
+    // instead of rebuilt, until its SAH cost exceeds rebuildThreshold times its
+    // cost when built. Without it, the BVH is rebuilt whenever the models move.
+    void enableRefit(float rebuildThreshold=1.3f) {
+        bvhRebuildThreshold = rebuildThreshold;
     }
     void enablePathTracing(int depth, int spp, bool pure=true) {
         pathTracing = true;
@@ -37,48 +85,157 @@ public:
         purePathTracing = pure;
     }
 
+    // Paths longer than minDepth are randomly terminated according to their
+    // throughput, the depth given to enablePathTracing() stays the hard limit
+    void enableRussianRoulette(int minDepth=3) {
+        russianRoulette = true;
+        rouletteMinDepth = minDepth;
+    }
+
+    // Sample the emissive models explicitly at each bounce, combined with
+    // hemisphere sampling by multiple importance sampling
+    void enableNextEventEstimation() {
+        nextEventEstimation = true;
+    }
+
     void enagleCosineWeighted() {
         cosineWeighted = true;
     }
 
+    // The Q-table is shared by the threads, so with more than one thread the
+    // learnt values, and the render, depend on the order of the updates
     void enableLearningLT() {
         learningLT = true;
     }
 
-    void render(Image& img, const Scene& scene) {
+    // Start learning from the Q-table saved in filename by a previous render, and
+    // save the table learnt by this one to it. Leaves are matched by their bounds,
+    // so a modified scene still reuses the leaves it has in common (BVH only).
+    void enableQtableSnapshot(const std::string& filename) {
+        qtableSnapshot = filename;
+    }
+
+    // Trace the camera rays of a pixel, or of neighbouring pixels without
+    // anti-aliasing, by packets of SIMD_WIDTH rays through the BVH
+    void enableRayPackets() {
+        rayPackets = true;
+    }
+
+    // Path tracing by stages over batches of up to maxPaths paths (generate, extend,
+    // shade, connect, scatter) instead of tracing each path from start to end
+    void enableWavefront(int maxPaths=1 << 18) {
+        wavefront = true;
+        wavefrontPaths = maxPaths;
+    }
+
+    // Render passes of passSpp samples per pixel until the time budget (in
+    // seconds) or the target mean pixel variance is reached, 0 disables a
+    // criterion. The samples per pixel of enablePathTracing() stay the limit.
+    // A pass is stratified over a square grid in the pixel: passSpp is rounded down to
+    // a square, and a pass takes at least one sample per pixel.
+    void enableProgressive(int passSpp, double budget, float variance=0.f) {
+        progressive = true;
+        int res = std::sqrt(std::max(passSpp, 1));
+        passSamples = res * res;
+        timeBudget = budget;
+        targetVariance = variance;
+    }
+
+    // Spend an average of budgetSpp samples per pixel, each pixel taking at least
+    // minSpp and the rest going to the pixels with the highest relative variance.
+    // The samples spent on each pixel are saved to samplesMap when given.
+    // minSpp must be at least 4: the first samples are split into two halves, each
+    // needing two samples to estimate a variance.
+    void enableAdaptiveSampling(int minSpp, int budgetSpp, const std::string& samplesMap="") {
+        if (minSpp < 4)
+            throw std::invalid_argument("Adaptive sampling needs at least 4 samples per pixel.");
+        adaptive = true;
+        adaptiveMinSamples = minSpp;
+        adaptiveBudget = budgetSpp;
+        samplesMapFilename = samplesMap;
+    }
+
+    // Save the image being rendered progressively every interval seconds
+    void enableSnapshots(const std::string& filename, double interval) {
+        snapshotFilename = filename;
+        snapshotInterval = interval;
+    }
+
+    // 0 uses every available core
+    void setNumberOfThreads(int threads) {
+        numberOfThreads = threads;
+    }
+
+    void setTileSize(int size) {
+        tileSize = size;
+    }
+
+    // Renders with the same seed are identical, whatever the number of threads
+    void setSeed(uint64_t s) {
+        seed = s;
+    }
+
+    void render(Image& img, Scene& scene) {
         int width = img.getWidth();
         int height = img.getHeight();
 
-        if (bvh)
-            pBvh = new BVH(scene.getModels(), bvhMinSplit);
+        // Instances are always traced through their own two-level BVH
+        SceneBVH::Settings settings;
+        settings.minSplit = bvhMinSplit;
+        settings.splitMethod = bvhSplitMethod;
+        settings.wide = bvhWide;
+        settings.watertight = watertight;
+        SceneBVH& accelerationStructure = scene.getAccelerationStructure();
+        accelerationStructure.update(scene.getModels(), scene.getInstances(), bvh, settings, bvhRebuildThreshold);
+        pBvh = accelerationStructure.getBVH();
+        pInstanceBvh = accelerationStructure.getInstanceBVH();
+        bvhUpdateTime = accelerationStructure.getUpdateTime();
 
-        if (learningLT)
-            qtable = new Qtable(10, 20, 0.25f); // resX <= resY
-        else if (cosineWeighted)
-            pHemisphereSampling = new CosigneWeighted();
-        else
-            pHemisphereSampling = new HemisphereSampling();
-
-        //#pragma omp parallel for collapse(2)
-        for(int i = 0; i < width; i++) {
-            for(int j = 0; j < height; j++) {
-                float x = i / (float) width;
-                float y = j / (float) height;
-                Vec3<float> pixelPosition = scene.getCamera().computePixelPosition(x, y);
-                Vec3<float> shading;
-
-                bool render = false;
-                if (pathTracing)
-                    render = pathTrace(i, j, img, scene, shading);
-                else if (antialiasing)
-                    render = antiAliasing(i, j, img, scene, shading);
-                else
-                    render = computePixelShading(pixelPosition, scene, shading);
-
-                if (render)
-                    img(i, j) = shading;
-            }
+        if (nextEventEstimation)
+            emitterSampling = EmitterSampling(scene.getModels(), scene.getInstances());
+
+        // Snapshots only hold the leaves of the BVH of the models
+        bool snapshot = learningLT && pBvh && !qtableSnapshot.empty();
+        if (learningLT) {
+            int numberOfLeaves = (pBvh ? pBvh->getNumberOfLeaves() : 0) + (pInstanceBvh ? pInstanceBvh->getNumberOfLeaves() : 0);
+            delete qtable;
+            qtable = new Qtable(scene.getModels(), numberOfLeaves, 10, 20, 0.25f); // resX <= resY
+            for (const Instance* instance: scene.getInstances())
+                qtable->addMaterial(instance->getMaterial());
+        } else {
+            delete pHemisphereSampling;
+            if (cosineWeighted)
+                pHemisphereSampling = new CosigneWeighted();
+            else
+                pHemisphereSampling = new HemisphereSampling();
         }
+
+        uint64_t sceneHash = snapshot ? scene.computeHash() : 0;
+        if (snapshot)
+            qtable->load(qtableSnapshot, *pBvh, sceneHash);
+
+        int threads = numberOfThreads > 0 ? numberOfThreads : omp_get_max_threads();
+
+        std::vector<double> busyTime(threads, 0.);
+        std::vector<int> tilesRendered(threads, 0);
+        double start = omp_get_wtime();
+
+        if (adaptive && pathTracing) {
+            renderAdaptive(img, scene, threads, busyTime, tilesRendered);
+        } else if (progressive && pathTracing) {
+            renderProgressive(img, scene, threads, busyTime, tilesRendered);
+        } else if (wavefront && pathTracing) {
+            renderWavefront(img, scene, threads, busyTime);
+        } else {
+            renderTiles(width, height, threads, busyTime, tilesRendered, [&](int x0, int y0, int x1, int y1) {
+                renderTile(x0, y0, x1, y1, img, scene);
+            });
+        }
+
+        printRenderInfos(omp_get_wtime() - start, busyTime, tilesRendered);
+
+        if (snapshot)
+            qtable->save(qtableSnapshot, *pBvh, sceneHash);
     }
 
     void printInfos() {
@@ -86,69 +243,609 @@ public:
         std::cout << "      Shadow:                     " << (shadow == 0 ? "OFF" : "ON") << std::endl;
         std::cout << "      Anti-Aliasing:              " << (antialiasing == 0 ? "OFF" : "ON") << std::endl;
         std::cout << "      BVH:                        " << (bvh == 0 ? "OFF" : "ON") << std::endl;
+        std::cout << "      BVH Refit:                  " << (bvhRebuildThreshold <= 0.f ? "OFF" : "ON");
+        if (bvhRebuildThreshold > 0.f)
+            std::cout << " (rebuilt past " << bvhRebuildThreshold << "x the SAH cost)";
+        std::cout << std::endl;
         std::cout << "      Path-Tracing:               " << (pathTracing == 0 ? "OFF" : "ON") << std::endl;
         std::cout << "      Pure Path-Tracing:          " << (purePathTracing == 0 ? "OFF" : "ON") << std::endl;
+        std::cout << "      Russian Roulette:           " << (russianRoulette == 0 ? "OFF" : "ON") << std::endl;
+        std::cout << "      Next Event Estimation:      " << (nextEventEstimation == 0 ? "OFF" : "ON") << std::endl;
+        std::cout << "      Progressive Rendering:      " << (progressive == 0 ? "OFF" : "ON") << std::endl;
+        std::cout << "      Adaptive Sampling:          " << (adaptive == 0 ? "OFF" : "ON") << std::endl;
         std::cout << "      Cosine Weighted Sampling:   " << (cosineWeighted == 0 ? "OFF" : "ON") << std::endl;
         std::cout << "      Learning Light Transport:   " << (learningLT == 0 ? "OFF" : "ON") << std::endl;
+        std::cout << "      Watertight Intersection:    " << (watertight == 0 ? "OFF" : "ON") << std::endl;
+        std::cout << "      Ray Packets:                " << (rayPackets == 0 ? "OFF" : "ON")
+                  << " (" << RayPacket::size << " rays)" << std::endl;
+        std::cout << "      Wavefront:                  " << (wavefront == 0 ? "OFF" : "ON") << std::endl;
     }
 
 private:
-    bool iterateThroughIndices(const Ray& ray,
-                  const std::vector<Model*>& models,
-                  Ray::Hit& hit) {
-        std::map<int, std::vector<int>> indices;
-        if (bvh && !pBvh->intersect(ray, indices))
-            return false;
+    // Tiles are handed out dynamically: background tiles finish quickly
+    // while tiles covering dense geometry take much longer
+    template <typename TileRenderer>
+    void renderTiles(int width, int height, int threads,
+                     std::vector<double>& busyTime, std::vector<int>& tilesRendered,
+                     const TileRenderer& renderTile) {
+        int tilesX = (width + tileSize - 1) / tileSize;
+        int tilesY = (height + tileSize - 1) / tileSize;
 
-        float e = -1;
-        bool foundHit = false;
-        Ray::Hit currentHit;
+        #pragma omp parallel for schedule(dynamic, 1) num_threads(threads)
+        for (int tile = 0; tile < tilesX * tilesY; tile++) {
+            double tileStart = omp_get_wtime();
+            int x0 = (tile % tilesX) * tileSize;
+            int y0 = (tile / tilesX) * tileSize;
+            renderTile(x0, y0, std::min(x0 + tileSize, width), std::min(y0 + tileSize, height));
 
-        auto it = indices.begin();
-        for (std::size_t i = 0; i < models.size() + indices.size(); i++) {
-            std::vector<int> relevantIndices;
-            if (bvh) {
-                if (it == indices.end())
-                    break;
-                i = it->first;
-                relevantIndices = it->second;
-                it++;
+            int thread = omp_get_thread_num();
+            busyTime[thread] += omp_get_wtime() - tileStart;
+            tilesRendered[thread]++;
+        }
+    }
+
+    // Passes of passSamples samples per pixel are accumulated until the
+    // time budget, the target variance or the samples per pixel are reached
+    void renderProgressive(Image& img, const Scene& scene, int threads,
+                           std::vector<double>& busyTime, std::vector<int>& tilesRendered) {
+        int width = img.getWidth();
+        int height = img.getHeight();
+        const Image background = img;
+        AccumulationBuffer buffer(width, height);
+
+        int maxPasses = std::max(samplesPerPixel / passSamples, 1);
+        double start = omp_get_wtime();
+        double lastSnapshot = start;
+        double passTime = 0.;
+        float variance = 0.f;
+        int pass = 0;
+        while (true) {
+            double passStart = omp_get_wtime();
+            renderTiles(width, height, threads, busyTime, tilesRendered, [&](int x0, int y0, int x1, int y1) {
+                accumulateTile(x0, y0, x1, y1, pass, background, scene, buffer);
+            });
+            pass++;
+
+            double now = omp_get_wtime();
+            passTime = now - passStart;
+            variance = buffer.meanVariance();
+            buffer.resolve(img);
+
+            // Stop before a pass would overrun the time budget
+            if (pass >= maxPasses
+                    || (timeBudget > 0. && now - start + passTime > timeBudget)
+                    || (targetVariance > 0.f && variance <= targetVariance))
+                break;
+
+            if (!snapshotFilename.empty() && now - lastSnapshot >= snapshotInterval) {
+                img.savePPM(snapshotFilename);
+                lastSnapshot = now;
             }
+        }
 
-            Model* model = models[i];
-            if(ray.intersect(*model, currentHit, relevantIndices) && (currentHit.distance < e || !foundHit)) {
-                hit = currentHit;
-                foundHit = true;
-                e = hit.distance;
+        std::cout << "RayTracer.h" << std::endl;
+        std::cout << "      Progressive passes:         " << pass << std::endl;
+        std::cout << "      Samples per pixel:          " << pass * passSamples << std::endl;
+        std::cout << "      Mean pixel variance:        " << variance << std::endl;
+    }
+
+    // Every pixel first gets minSamples, alternately added to two halves, then the
+    // rest of the budget is spent in rounds, each pixel receiving a share proportional
+    // to its relative variance. The extra samples of a half are allocated from the
+    // variance of the first samples of the other half, so that no sample decides how
+    // many samples its own half gets: the mean of each half is unbiased, and so is
+    // the pixel, the average of both. Pixels that got lucky bright samples are not
+    // rewarded with more samples averaged with them.
+    void renderAdaptive(Image& img, const Scene& scene, int threads,
+                        std::vector<double>& busyTime, std::vector<int>& tilesRendered) {
+        int width = img.getWidth();
+        int height = img.getHeight();
+        int pixels = width * height;
+        const Image background = img;
+        AccumulationBuffer halves[2] = {AccumulationBuffer(width, height), AccumulationBuffer(width, height)};
+
+        // First samples, sample s of a pixel goes to half s % 2
+        renderTiles(width, height, threads, busyTime, tilesRendered, [&](int x0, int y0, int x1, int y1) {
+            for (int j = y0; j < y1; j++) {
+                for (int i = x0; i < x1; i++) {
+                    Random rng(seed, i + j * width);
+                    for (int s = 0; s < adaptiveMinSamples; s++) {
+                        Vec3<float> sample;
+                        tracePixelSample(i, j, rng.nextFloat() - 0.5f, rng.nextFloat() - 0.5f,
+                                         background, scene, sample, rng);
+                        halves[s % 2].add(i, j, sample);
+                    }
+                }
+            }
+        });
+        long long budget = (long long) adaptiveBudget * pixels;
+        long long spent = (long long) adaptiveMinSamples * pixels;
+        int round = 1;
+
+        // Relative variance of each pixel in each half, from the first samples only
+        std::vector<float> error[2];
+        double totalError[2] = {0., 0.};
+        for (int h = 0; h < 2; h++) {
+            const AccumulationBuffer& buffer = halves[h];
+
+            // Few samples can all agree by chance (e.g. no path reaching a light yet):
+            // the variance of each pixel is blended with the mean variance of the image
+            double meanSampleVariance = 0.;
+            for (int j = 0; j < height; j++)
+                for (int i = 0; i < width; i++)
+                    meanSampleVariance += buffer.variance(i, j) * buffer.getCount(i, j);
+            meanSampleVariance /= pixels;
+
+            error[h].resize(pixels);
+            for (int j = 0; j < height; j++) {
+                for (int i = 0; i < width; i++) {
+                    int n = buffer.getCount(i, j);
+                    float l = AccumulationBuffer::luminance(buffer.mean(i, j));
+                    float variance = buffer.variance(i, j) + meanSampleVariance / (n * (double) n);
+                    error[h][i + j * width] = variance / (l*l + 1e-3f);
+                    totalError[h] += error[h][i + j * width];
+                }
             }
         }
 
-        return foundHit;
+        int maxPerRound = adaptiveRoundFactor * adaptiveMinSamples / 2;
+        std::vector<int> allocation[2] = {std::vector<int>(pixels), std::vector<int>(pixels)};
+        while (totalError[0] > 0. && totalError[1] > 0.) {
+            // At most as many samples as the first ones, half of them for each half
+            long long batch = std::min(budget - spent, (long long) adaptiveMinSamples * pixels) / 2;
+            if (batch <= 0)
+                break;
+
+            long long allocated = 0;
+            for (int h = 0; h < 2; h++) {
+                const std::vector<float>& otherError = error[1 - h];
+                for (int k = 0; k < pixels; k++) {
+                    allocation[h][k] = std::min((int) (batch * (otherError[k] / totalError[1 - h])), maxPerRound);
+                    allocated += allocation[h][k];
+                }
+            }
+            if (allocated == 0)
+                break;
+
+            renderTiles(width, height, threads, busyTime, tilesRendered, [&](int x0, int y0, int x1, int y1) {
+                for (int j = y0; j < y1; j++) {
+                    for (int i = x0; i < x1; i++) {
+                        Random rng(seed + round, i + j * width);
+                        for (int h = 0; h < 2; h++) {
+                            for (int s = 0; s < allocation[h][i + j * width]; s++) {
+                                Vec3<float> sample;
+                                tracePixelSample(i, j, rng.nextFloat() - 0.5f, rng.nextFloat() - 0.5f,
+                                                 background, scene, sample, rng);
+                                halves[h].add(i, j, sample);
+                            }
+                        }
+                    }
+                }
+            });
+            spent += allocated;
+            round++;
+        }
+
+        // Both halves have equal weights, whatever their number of samples
+        int maxCount = 0;
+        double meanVariance = 0.;
+        for (int j = 0; j < height; j++) {
+            for (int i = 0; i < width; i++) {
+                img(i, j) = 0.5f * (halves[0].mean(i, j) + halves[1].mean(i, j));
+                maxCount = std::max(maxCount, halves[0].getCount(i, j) + halves[1].getCount(i, j));
+                meanVariance += 0.25 * (halves[0].variance(i, j) + halves[1].variance(i, j));
+            }
+        }
+        meanVariance /= pixels;
+
+        std::cout << "RayTracer.h" << std::endl;
+        std::cout << "      Adaptive rounds:            " << round << std::endl;
+        std::cout << "      Samples spent:              " << spent << " / " << budget << std::endl;
+        std::cout << "      Max samples per pixel:      " << maxCount << std::endl;
+        std::cout << "      Mean pixel variance:        " << meanVariance << std::endl;
+
+        // Samples per pixel, white for the most sampled pixels
+        if (!samplesMapFilename.empty()) {
+            Image samplesMap(width, height);
+            for (int j = 0; j < height; j++) {
+                for (int i = 0; i < width; i++) {
+                    float v = (halves[0].getCount(i, j) + halves[1].getCount(i, j)) / (float) std::max(maxCount, 1);
+                    samplesMap(i, j) = Vec3<float>(v, v, v);
+                }
+            }
+            samplesMap.savePPM(samplesMapFilename);
+        }
     }
 
-    bool iterateThroughNodes(const Ray& ray,
-                  const std::vector<Model*>& models,
-                  Ray::Hit& hit) {
-        // BVH required!
-        if (!bvh)
-            return false;
+    // Runs body(k) for k in [0, count) on the given threads, the time each thread
+    // spends in it is added to busyTime
+    template <typename Body>
+    static void runStage(int count, int threads, std::vector<double>& busyTime, const Body& body) {
+        #pragma omp parallel num_threads(threads)
+        {
+            double start = omp_get_wtime();
+            #pragma omp for schedule(dynamic, 64) nowait
+            for (int k = 0; k < count; k++)
+                body(k);
+            busyTime[omp_get_thread_num()] += omp_get_wtime() - start;
+        }
+    }
 
-        std::vector<BVH::Node*> nodesIntersected;
-        if (!pBvh->intersect(ray, nodesIntersected))
-            return false;
+    // Spreads the 10 lowest bits of v every 3 bits
+    static uint32_t expandBits(uint32_t v) {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+    // Rays of the same octant are grouped, and sorted along a Morton curve over
+    // their origins inside the octant, so that neighbouring rays visit the same nodes
+    static uint32_t sortKey(const Vec3<float>& origin, const Vec3<float>& direction, const AABB& bounds) {
+        Vec3<float> extent = bounds.getMaxBound() - bounds.getMinBound();
+        uint32_t morton = 0;
+        for (int axis = 0; axis < 3; axis++) {
+            float x = extent[axis] > 0.f ? (origin[axis] - bounds.getMinBound()[axis]) / extent[axis] : 0.f;
+            uint32_t cell = (uint32_t) std::min(std::max(x * 1024.f, 0.f), 1023.f);
+            morton |= expandBits(cell) << (2 - axis);
+        }
+
+        uint32_t octant = (direction[0] < 0.f) | (direction[1] < 0.f) << 1 | (direction[2] < 0.f) << 2;
+        return octant << 29 | morton >> 1;
+    }
+
+    // Path tracing by batches of paths, each bounce running over the whole batch
+    // one stage after the other:
+    //   - generate: camera rays of the pixels of the batch
+    //   - extend:   closest hit of the sorted rays of the live paths
+    //   - shade:    emitted light, and the shadow rays towards the lights
+    //   - connect:  shadow rays, the light of the visible ones is gathered
+    //   - scatter:  Q-table update and direction of the next bounce
+    // The code of a stage and the data it touches stay in cache over the batch
+    void renderWavefront(Image& img, const Scene& scene, int threads, std::vector<double>& busyTime) {
+        int width = img.getWidth();
+        int pixels = width * img.getHeight();
+        int res = std::sqrt(samplesPerPixel);
+        int spp = res * res;
+        if (boundDepth <= 0 || spp == 0)
+            return;
+
+        int lightConnections = purePathTracing ? 0 : scene.getLights().size();
+        int connections = lightConnections + (nextEventEstimation ? 1 : 0);
+        int pixelsPerBatch = std::max(wavefrontPaths / spp, 1);
+
+        AABB bounds;
+        for (const Model* model: scene.getModels())
+            bounds.update(model->getAABB());
+        for (const Instance* instance: scene.getInstances())
+            bounds.update(instance->getAABB());
+
+        PathStates paths;
+        std::vector<int> active;
+        std::vector<uint64_t> keys;
+        std::vector<Ray> rays;
+        std::vector<Ray::Hit> hits;
+        const int chunkSize = 64 * RayPacket::size;
+
+        double stageTime[5] = {0., 0., 0., 0., 0.};
+        long long extensionRays = 0, shadowRays = 0;
+        int batches = 0;
+        for (int p0 = 0; p0 < pixels; p0 += pixelsPerBatch) {
+            int p1 = std::min(p0 + pixelsPerBatch, pixels);
+            int count = (p1 - p0) * spp;
+            batches++;
+
+            // Generate: stratified camera rays through each pixel
+            double stageStart = omp_get_wtime();
+            paths.resize(count, connections);
+            runStage(p1 - p0, threads, busyTime, [&](int k) {
+                int pixel = p0 + k;
+                float step = 0.5f / (float) res;
+                for (int s = 0; s < spp; s++) {
+                    float xShift = -0.5f + step + (2.f * (s / res) * step);
+                    float yShift = -0.5f + step + (2.f * (s % res) * step);
+                    int p = k * spp + s;
+                    paths.start(p, pixel, cameraRay(pixel % width, pixel / width, xShift, yShift, img, scene),
+                                Random(seed, (uint64_t) pixel * spp + s));
+                }
+            });
+            active.resize(count);
+            for (int p = 0; p < count; p++)
+                active[p] = p;
+            stageTime[0] += omp_get_wtime() - stageStart;
+
+            while (!active.empty()) {
+                int n = active.size();
+
+                // Extend
+                stageStart = omp_get_wtime();
+                keys.resize(n);
+                runStage(n, threads, busyTime, [&](int k) {
+                    int p = active[k];
+                    keys[k] = (uint64_t) sortKey(paths.origin[p], paths.direction[p], bounds) << 32 | (uint32_t) p;
+                });
+                std::sort(keys.begin(), keys.end());
+                rays.clear();
+                for (int k = 0; k < n; k++) {
+                    active[k] = (int) (keys[k] & 0xFFFFFFFFu);
+                    rays.emplace_back(paths.origin[active[k]], paths.direction[active[k]]);
+                }
+                hits.assign(n, Ray::Hit());
+                runStage((n + chunkSize - 1) / chunkSize, threads, busyTime, [&](int c) {
+                    int k0 = c * chunkSize;
+                    int k1 = std::min(k0 + chunkSize, n);
+                    traceRays(&rays[k0], k1 - k0, scene, &hits[k0]);
+                    for (int k = k0; k < k1; k++)
+                        paths.hit[active[k]] = hits[k];
+                });
+                extensionRays += n;
+                stageTime[1] += omp_get_wtime() - stageStart;
+
+                // Shade
+                stageStart = omp_get_wtime();
+                runStage(n, threads, busyTime, [&](int k) {
+                    int p = active[k];
+                    const Ray::Hit& hit = paths.hit[p];
+                    if (!hit.m) {
+                        paths.alive[p] = false;
+                        return;
+                    }
+                    if (paths.depth[p] == 0)
+                        paths.cameraHit[p] = true;
+
+                    const Material& material = hit.getMaterial();
+                    Vec3<float> emitted = material.getEmittedLevel() * material.getColor();
+                    const Vec3<float>& throughput = paths.throughput[p];
+                    const Vec3<float>& direction = paths.direction[p];
+                    paths.radiance[p] += throughput * emitted
+                                         * emissionWeight(hit, direction, paths.depth[p], paths.directionPdf[p]);
+                    paths.hitShading[p] = emitted;
+
+                    Vec3<float> hitPosition = paths.origin[p] + hit.distance * direction;
+                    Random& rng = paths.rng[p];
+                    PathStates::Connection* connection = paths.getConnections(p);
+                    for (int l = 0; l < lightConnections; l++, connection++) {
+                        const Light& light = *scene.getLights()[l];
+                        Vec3<float> lightPos = light.samplePosition(rng);
+                        Vec3<float> lightDirection = normalize(lightPos - hitPosition);
+                        Vec3<float> response = light.getIntensity()
+                                               * material.evaluateColorResponse(hit.interpolatedNormal,
+                                                                                lightDirection, -direction);
+                        connection->origin = Ray::spawn(hitPosition, hit.faceNormal, lightDirection).getOrigin();
+                        connection->direction = lightDirection;
+                        connection->distance = dist(lightPos, hitPosition);
+                        connection->test = shadow;
+                        connection->contribution = throughput * response;
+                        connection->direct = response;
+                    }
+
+                    if (nextEventEstimation) {
+                        connection->distance = -1.f;
+                        EmitterSampling::Sample ls;
+                        Vec3<float> lightDirection;
+                        float distance, lightProbability;
+                        if (!endsPath(material, paths.depth[p])
+                                && sampleEmitterPoint(hit, hitPosition, rng, ls, lightDirection, distance, lightProbability)) {
+                            // Stop short of the emitter itself
+                            connection->origin = Ray::spawn(hitPosition, hit.faceNormal, lightDirection).getOrigin();
+                            connection->direction = lightDirection;
+                            connection->distance = distance * 0.999f;
+                            connection->test = true;
+                            connection->contribution = throughput * emitterContribution(hit, -direction, ls, lightDirection,
+                                                                                        lightProbability);
+                            connection->direct = Vec3<float>(0.f, 0.f, 0.f);
+                        }
+                    }
+                });
+                stageTime[2] += omp_get_wtime() - stageStart;
+
+                // Connect
+                stageStart = omp_get_wtime();
+                runStage(n, threads, busyTime, [&](int k) {
+                    int p = active[k];
+                    if (!paths.alive[p])
+                        return;
+
+                    const PathStates::Connection* connection = paths.getConnections(p);
+                    for (int c = 0; c < connections; c++, connection++) {
+                        if (connection->distance < 0.f)
+                            continue;
+                        if (connection->test && occluded(Ray(connection->origin, connection->direction),
+                                                         scene.getModels(), connection->distance))
+                            continue;
+                        paths.radiance[p] += connection->contribution;
+                        paths.hitShading[p] += connection->direct;
+                    }
+                });
+                for (int k = 0; k < n; k++) {
+                    if (!paths.alive[active[k]])
+                        continue;
+                    const PathStates::Connection* connection = paths.getConnections(active[k]);
+                    for (int c = 0; c < connections; c++)
+                        shadowRays += connection[c].distance >= 0.f && connection[c].test;
+                }
+                stageTime[3] += omp_get_wtime() - stageStart;
+
+                // Scatter
+                stageStart = omp_get_wtime();
+                runStage(n, threads, busyTime, [&](int k) {
+                    int p = active[k];
+                    if (!paths.alive[p])
+                        return;
+
+                    const Ray::Hit& hit = paths.hit[p];
+                    const Material& material = hit.getMaterial();
+                    Random& rng = paths.rng[p];
+                    int nHit = leafId(hit);
+                    if (learningLT && paths.qOrigin[p] >= 0 && nHit >= 0 && paths.sampleIndex[p] >= 0)
+                        qtable->update(paths.qOrigin[p], nHit, paths.sampleIndex[p], paths.hitShading[p], material, rng);
+
+                    HemisphereSampling::Sample sample;
+                    if (endsPath(material, paths.depth[p])
+                            || !scatter(-paths.direction[p], hit, paths.depth[p], paths.throughput[p], sample, rng)) {
+                        paths.alive[p] = false;
+                        return;
+                    }
+
+                    Vec3<float> hitPosition = paths.origin[p] + hit.distance * paths.direction[p];
+                    paths.origin[p] = Ray::spawn(hitPosition, hit.faceNormal, sample.direction).getOrigin();
+                    paths.direction[p] = sample.direction;
+                    paths.qOrigin[p] = nHit;
+                    paths.sampleIndex[p] = sample.index;
+                    paths.directionPdf[p] = sample.probability;
+                    paths.depth[p]++;
+                });
+                active.erase(std::remove_if(active.begin(), active.end(), [&](int p) { return !paths.alive[p]; }),
+                             active.end());
+                stageTime[4] += omp_get_wtime() - stageStart;
+            }
+
+            // Samples of camera rays missing everything are the background
+            for (int pixel = p0; pixel < p1; pixel++) {
+                int i = pixel % width, j = pixel / width;
+                Vec3<float> shading(0.f, 0.f, 0.f);
+                bool pathTraced = false;
+                for (int p = (pixel - p0) * spp; p < (pixel - p0 + 1) * spp; p++) {
+                    shading += paths.cameraHit[p] ? paths.radiance[p] : img(i, j);
+                    pathTraced |= paths.cameraHit[p];
+                }
+                if (pathTraced)
+                    img(i, j) = shading / (float) spp;
+            }
+        }
+
+        std::cout << "RayTracer.h" << std::endl;
+        std::cout << "      Wavefront batches:          " << batches << std::endl;
+        std::cout << "      Extension rays:             " << extensionRays << std::endl;
+        std::cout << "      Shadow rays:                " << shadowRays << std::endl;
+        std::cout << "      Generate (s):               " << stageTime[0] << std::endl;
+        std::cout << "      Extend (s):                 " << stageTime[1] << std::endl;
+        std::cout << "      Shade (s):                  " << stageTime[2] << std::endl;
+        std::cout << "      Connect (s):                " << stageTime[3] << std::endl;
+        std::cout << "      Scatter (s):                " << stageTime[4] << std::endl;
+    }
+
+    // No bounce after a light reached by pure path tracing, or after the last bounce
+    bool endsPath(const Material& material, int depth) const {
+        return (purePathTracing && material.getEmittedLevel() > 0.99) || depth + 1 == boundDepth;
+    }
+
+    void accumulateTile(int x0, int y0, int x1, int y1, int pass,
+                        const Image& background, const Scene& scene, AccumulationBuffer& buffer) {
+        int width = background.getWidth();
+        int res = std::sqrt(passSamples);    // passSamples is a square
+        for (int j = y0; j < y1; j++) {
+            for (int i = x0; i < x1; i++) {
+                Random rng(seed + pass, i + j * width);
+
+                // Stratified over the pixel, jittered so that passes don't repeat each other
+                for (int k = 0; k < res; k++) {
+                    for (int l = 0; l < res; l++) {
+                        float xShift = -0.5f + (k + rng.nextFloat()) / res;
+                        float yShift = -0.5f + (l + rng.nextFloat()) / res;
+                        Vec3<float> sample;
+                        tracePixelSample(i, j, xShift, yShift, background, scene, sample, rng);
+                        buffer.add(i, j, sample);
+                    }
+                }
+            }
+        }
+    }
+
+    void renderTile(int x0, int y0, int x1, int y1, Image& img, const Scene& scene) {
+        int width = img.getWidth();
+        int tileWidth = x1 - x0;
 
+        // The tile is accumulated locally and copied to the image once done
+        std::vector<Vec3<float>> tile(tileWidth * (y1 - y0));
+        std::vector<char> rendered(tile.size(), 0);
+        if (!pathTracing && !antialiasing) {
+            renderTileRows(x0, y0, x1, y1, img, scene, tile, rendered);
+        } else {
+            for (int j = y0; j < y1; j++) {
+                for (int i = x0; i < x1; i++) {
+                    int k = (i - x0) + (j - y0) * tileWidth;
+                    Random rng(seed, i + j * width);
+
+                    if (pathTracing)
+                        rendered[k] = pathTrace(i, j, img, scene, tile[k], rng);
+                    else
+                        rendered[k] = antiAliasing(i, j, img, scene, tile[k], rng);
+                }
+            }
+        }
+
+        for (int j = y0; j < y1; j++)
+            for (int i = x0; i < x1; i++)
+                if (rendered[(i - x0) + (j - y0) * tileWidth])
+                    img(i, j) = tile[(i - x0) + (j - y0) * tileWidth];
+    }
+
+    // One camera ray through each pixel, the rays of a row are traced together
+    void renderTileRows(int x0, int y0, int x1, int y1, const Image& img, const Scene& scene,
+                        std::vector<Vec3<float>>& tile, std::vector<char>& rendered) {
+        int width = img.getWidth();
+        int height = img.getHeight();
+        int tileWidth = x1 - x0;
+        const Vec3<float>& cameraPosition = scene.getCamera().getPosition();
+
+        std::vector<Ray> rays;
+        std::vector<Ray::Hit> hits;
+        for (int j = y0; j < y1; j++) {
+            rays.clear();
+            for (int i = x0; i < x1; i++) {
+                Vec3<float> pixelPosition = scene.getCamera().computePixelPosition(i / (float) width, j / (float) height);
+                rays.emplace_back(cameraPosition, normalize(pixelPosition - cameraPosition));
+            }
+            traceCameraRays(rays, scene, hits);
+
+            for (int i = x0; i < x1; i++) {
+                const Ray::Hit& hit = hits[i - x0];
+                if (!hit.m)
+                    continue;
+
+                int k = (i - x0) + (j - y0) * tileWidth;
+                Random rng(seed, i + j * width);
+                tile[k] = computeHitShading(rays[i - x0], hit, scene, rng);
+                rendered[k] = true;
+            }
+        }
+    }
+
+    void printRenderInfos(double renderTime, const std::vector<double>& busyTime,
+                          const std::vector<int>& tilesRendered) const {
+        double maxBusyTime = 0., totalBusyTime = 0.;
+        for (double t: busyTime) {
+            maxBusyTime = std::max(maxBusyTime, t);
+            totalBusyTime += t;
+        }
+
+        std::cout << "RayTracer.h" << std::endl;
+        std::cout << "      Render time (s):            " << renderTime << std::endl;
+        std::cout << "      BVH update time (s):        " << bvhUpdateTime << std::endl;
+        std::cout << "      Threads:                    " << busyTime.size() << std::endl;
+        std::cout << "      Tile size:                  " << tileSize << std::endl;
+        for (std::size_t t = 0; t < busyTime.size(); t++)
+            std::cout << "      Thread " << std::setw(3) << std::left << t << std::right
+                      << "busy (s):           " << busyTime[t]
+                      << " (" << tilesRendered[t] << " tiles)" << std::endl;
+        if (totalBusyTime > 0.)
+            std::cout << "      Load imbalance (max/mean):  "
+                      << maxBusyTime * busyTime.size() / totalBusyTime << std::endl;
+    }
+
+    bool iterateThroughModels(const Ray& ray,
+                  const std::vector<Model*>& models,
+                  Ray::Hit& hit) {
         float e = -1;
         bool foundHit = false;
         Ray::Hit currentHit;
-        for (BVH::Node* node: nodesIntersected) {
-            for (auto& item: node->indices) {
-                Model* model = models[item.first];
-                if(ray.intersect(*model, currentHit, item.second) && (currentHit.distance < e || !foundHit)) {
-                    hit = currentHit;
-                    hit.info = node;
-                    foundHit = true;
-                    e = hit.distance;
-                }
+        for (Model* model: models) {
+            if(ray.intersect(*model, currentHit) && (currentHit.distance < e || !foundHit)) {
+                hit = currentHit;
+                foundHit = true;
+                e = hit.distance;
             }
         }
 
@@ -158,112 +855,313 @@ private:
     bool rayTrace(const Ray& ray,
                   const std::vector<Model*>& models,
                   Ray::Hit& hit) {
-        if (learningLT)
-            return iterateThroughNodes(ray, models, hit);
-        else
-            return iterateThroughIndices(ray, models, hit);
+        bool foundHit = pBvh ? pBvh->intersect(ray, hit) : iterateThroughModels(ray, models, hit);
+        if (pInstanceBvh) {
+            if (foundHit)
+                ray.setTMax(hit.distance);
+            foundHit = pInstanceBvh->intersect(ray, hit) || foundHit;
+        }
+        return foundHit;
+    }
+
+    // Closest hit of each camera ray, a ray missing everything gets a hit without model
+    void traceCameraRays(const std::vector<Ray>& rays, const Scene& scene, std::vector<Ray::Hit>& hits) {
+        hits.assign(rays.size(), Ray::Hit());
+        traceRays(rays.data(), rays.size(), scene, hits.data());
+    }
+
+    // Packets are only worth it for neighbouring rays going the same way
+    void traceRays(const Ray* rays, int count, const Scene& scene, Ray::Hit* hits) {
+        if (!pBvh || !rayPackets) {
+            for (int k = 0; k < count; k++)
+                rayTrace(rays[k], scene.getModels(), hits[k]);
+            return;
+        }
+
+        bool found[RayPacket::size];
+        for (int k = 0; k < count; k += RayPacket::size) {
+            RayPacket packet(&rays[k], std::min(RayPacket::size, count - k));
+            pBvh->intersect(packet, &hits[k], found);
+
+            // The instances are traced ray by ray, beyond the hits of the packet
+            for (int j = 0; pInstanceBvh && j < packet.getCount(); j++) {
+                if (found[j])
+                    rays[k + j].setTMax(hits[k + j].distance);
+                pInstanceBvh->intersect(rays[k + j], hits[k + j]);
+            }
+        }
+    }
+
+    bool occluded(const Ray& ray,
+                  const std::vector<Model*>& models,
+                  float tMax) {
+        if (pBvh) {
+            ray.setTMax(tMax);
+            if (pBvh->occluded(ray))
+                return true;
+        } else {
+            for (Model* model: models)
+                if (ray.occluded(*model, tMax))
+                    return true;
+        }
+
+        if (pInstanceBvh) {
+            ray.setTMax(tMax);
+            return pInstanceBvh->occluded(ray);
+        }
+        return false;
     }
 
-    Vec3<float> computeHitShading(const Ray& ray, const Ray::Hit hit, const Scene& scene) {
-        const Model& model = *hit.m;
-        const auto& vertices = model.getVertices();
-        const auto& indices = model.getIndices();
-        Vec3<float> hitPosition = hit.b0*vertices[indices[hit.index][0]]
-                                + hit.b1*vertices[indices[hit.index][1]]
-                                + hit.b2*vertices[indices[hit.index][2]];
+    Vec3<float> computeHitShading(const Ray& ray, const Ray::Hit hit, const Scene& scene, Random& rng) {
+        Vec3<float> hitPosition = hit.b0*hit.getVertex(0)
+                                + hit.b1*hit.getVertex(1)
+                                + hit.b2*hit.getVertex(2);
 
         Vec3<float> shading(0.f, 0.f, 0.f);
         for (const auto& light: scene.getLights()) {
-            Vec3<float> lightPos = light->getPosition();
+            Vec3<float> lightPos = light->samplePosition(rng);
             Vec3<float> lightDirection = normalize(lightPos - hitPosition);
 
-            Ray shadowRay(hitPosition, lightDirection, &model, hit.index);
-            Ray::Hit shadowHit;
+            Ray shadowRay = Ray::spawn(hitPosition, hit.faceNormal, lightDirection);
 
-            if(!shadow || !rayTrace(shadowRay, scene.getModels(), shadowHit)
-                    || shadowHit.distance > dist(lightPos, hitPosition)) {
+            if(!shadow || !occluded(shadowRay, scene.getModels(), dist(lightPos, hitPosition))) {
                 shading += light->getIntensity()
-                           * model.getMaterial().evaluateColorResponse(hit.interpolatedNormal,
-                                                                       lightDirection,
-                                                                       -ray.getDirection());
+                           * hit.getMaterial().evaluateColorResponse(hit.interpolatedNormal,
+                                                                     lightDirection,
+                                                                     -ray.getDirection());
             }
         }
 
         return shading;
     }
 
-    HemisphereSampling::Sample sampleDirection(const Ray::Hit& hit) {
+    // Q-table state of the hit: the BVH leaf holding the triangle, -1 without a BVH.
+    // The leaves of the instances are numbered after those of the models.
+    int leafId(const Ray::Hit& hit) const {
+        if (!hit.info)
+            return -1;
+        if (hit.instance)
+            return (pBvh ? pBvh->getNumberOfLeaves() : 0) + pInstanceBvh->getLeafId(hit);
+        return pBvh->getLeafId(static_cast<const BVH::LinearNode*>(hit.info));
+    }
+
+    // Tangent space at the hit, the interpolated normal is the z axis
+    void computeFrame(const Ray::Hit& hit, Vec3<float>& right, Vec3<float>& up, Vec3<float>& normal) {
+        Vec3<float> n = -normalize(hit.interpolatedNormal);
+        up = hit.getVertex(0) - hit.getVertex(1);
+        right = normalize(cross(up, n));
+        up = normalize(cross(n, right));
+        normal = -n;
+    }
+
+    HemisphereSampling::Sample sampleDirection(const Ray::Hit& hit, Random& rng) {
         HemisphereSampling::Sample s;
         if (learningLT)
-            qtable->sampleDirection(static_cast<const BVH::Node*>(hit.info), s);
+            qtable->sampleDirection(leafId(hit), s, rng);
         else
-            pHemisphereSampling->sampleDirection(s);
+            pHemisphereSampling->sampleDirection(s, rng);
 
         // Compute coordinate system
-        const Model& model = *hit.m;
-        const auto& vertices = model.getVertices();
-        const auto& indices = model.getIndices();
-
-        Vec3<float> n = -normalize(hit.interpolatedNormal);
-        Vec3<float> up = vertices[indices[hit.index][0]] - vertices[indices[hit.index][1]];
-        Vec3<float> right = normalize(cross(up, n));
-        up = normalize(cross(n, right));
+        Vec3<float> right, up, normal;
+        computeFrame(hit, right, up, normal);
 
-        s.direction = s.direction[0] * right + s.direction[1] * up + s.direction[2] * (-n);
-        //s.direction = s.direction[0] * right + s.direction[2] * up + s.direction[1] * (-n);
+        s.direction = s.direction[0] * right + s.direction[1] * up + s.direction[2] * normal;
         return s;
     }
 
-    bool recursivePathTrace(const Ray& ray, const Scene& scene, int depth, Vec3<float>& shading,
-                            const BVH::Node* origin = nullptr,
-                            const int sampleIndex = -1) {
-        if (depth == 0)
+    // Density of sampleDirection() generating the direction
+    float directionProbability(const Ray::Hit& hit, const Vec3<float>& direction) {
+        Vec3<float> right, up, normal;
+        computeFrame(hit, right, up, normal);
+
+        Vec3<float> local(dot(direction, right), dot(direction, up), dot(direction, normal));
+        if (learningLT)
+            return qtable->probability(leafId(hit), local);
+        else
+            return pHemisphereSampling->probability(local);
+    }
+
+    static float powerHeuristic(float probability, float otherProbability) {
+        float p2 = probability * probability;
+        float sum = p2 + otherProbability * otherProbability;
+        return sum > 0.f ? p2 / sum : 0.f;
+    }
+
+    // Point sampled on the emissive triangles for next event estimation, false when it
+    // can't light the hit. lightProbability is the density with respect to the solid angle.
+    bool sampleEmitterPoint(const Ray::Hit& hit, const Vec3<float>& hitPosition, Random& rng,
+                            EmitterSampling::Sample& ls, Vec3<float>& lightDirection,
+                            float& distance, float& lightProbability) {
+        if (!emitterSampling.sample(rng, ls))
             return false;
 
-        Ray::Hit hit;
-        if (!rayTrace(ray, scene.getModels(), hit))
+        Vec3<float> toLight = ls.position - hitPosition;
+        distance = toLight.length();
+        if (distance <= 0.f)
             return false;
 
-        float emittedLevel = hit.m->getMaterial().getEmittedLevel();
-        shading = emittedLevel * hit.m->getMaterial().getColor();
+        lightDirection = toLight / distance;
+        float cosLight = std::abs(dot(ls.normal, lightDirection));
+        if (cosLight <= 0.f || dot(hit.interpolatedNormal, lightDirection) <= 0.f)
+            return false;
 
-        if (!purePathTracing) { // Direct lighting
-            shading += computeHitShading(ray, hit, scene);
-        }
+        lightProbability = ls.probability * distance * distance / cosLight;
+        return true;
+    }
 
-        // Update Q-table if learning enabled
-        auto nHit = static_cast<const BVH::Node*>(hit.info);
-        if (learningLT && origin && nHit && sampleIndex >= 0)
-            qtable->update(origin, nHit, sampleIndex, shading, hit.m->getMaterial());
+    // Light of the emitter point reaching the eye along wo, weighted against the
+    // chance of reaching it by sampling the hemisphere
+    Vec3<float> emitterContribution(const Ray::Hit& hit, const Vec3<float>& wo, const EmitterSampling::Sample& ls,
+                                    const Vec3<float>& lightDirection, float lightProbability) {
+        float weight = powerHeuristic(lightProbability, directionProbability(hit, lightDirection));
+        Vec3<float> response = hit.getMaterial().evaluateColorResponse(hit.interpolatedNormal,
+                                                                          lightDirection, wo);
+        return (ls.emission * response) * (weight / lightProbability);
+    }
 
-        if (purePathTracing)
-            if (hit.m->getMaterial().getEmittedLevel() > 0.99) // Considered a light source
-                return true;
+    // Next event estimation: light from a point sampled on the emissive triangles
+    Vec3<float> sampleEmitters(const Ray& ray, const Ray::Hit& hit, const Vec3<float>& hitPosition,
+                               const Scene& scene, Random& rng) {
+        EmitterSampling::Sample ls;
+        Vec3<float> lightDirection;
+        float distance, lightProbability;
+        if (!sampleEmitterPoint(hit, hitPosition, rng, ls, lightDirection, distance, lightProbability))
+            return Vec3<float>(0.f, 0.f, 0.f);
 
-        Vec3<float> hitPosition = ray.getOrigin() + hit.distance*ray.getDirection();
-        auto sample = sampleDirection(hit);
-        Ray newRay = Ray(hitPosition, sample.direction, hit.m, hit.index);
-
-        // Indirect lighting
-        Vec3<float> indirectShading;
-        recursivePathTrace(newRay, scene, depth-1, indirectShading, nHit, sample.index);
-        Vec3<float> response = hit.m->getMaterial().evaluateColorResponse(hit.interpolatedNormal,
-                                                                  newRay.getDirection(),
-                                                                  -ray.getDirection());
-        shading += (response * indirectShading) / sample.probability;
-        shading[0] = std::min(shading[0], 1.f);
-        shading[1] = std::min(shading[1], 1.f);
-        shading[2] = std::min(shading[2], 1.f);
+        // Stop short of the emitter itself
+        Ray shadowRay = Ray::spawn(hitPosition, hit.faceNormal, lightDirection);
+        if (occluded(shadowRay, scene.getModels(), distance * 0.999f))
+            return Vec3<float>(0.f, 0.f, 0.f);
+
+        return emitterContribution(hit, -ray.getDirection(), ls, lightDirection, lightProbability);
+    }
+
+    // Weight of the light of an emitter reached along direction by the bounce of density
+    // directionPdf, against the chance of sampling it explicitly from the previous bounce
+    float emissionWeight(const Ray::Hit& hit, const Vec3<float>& direction, int depth, float directionPdf) const {
+        if (!nextEventEstimation || depth == 0 || hit.getMaterial().getEmittedLevel() <= 0.f)
+            return 1.f;
+
+        float cosLight = std::abs(dot(hit.faceNormal, direction));
+        float lightPdf = cosLight > 0.f ? emitterSampling.getProbability() * hit.distance * hit.distance / cosLight
+                                        : std::numeric_limits<float>::max();
+        return powerHeuristic(directionPdf, lightPdf);
+    }
+
+    // Samples the direction of the next bounce and updates the throughput of the
+    // path, false when Russian roulette stops it
+    bool scatter(const Vec3<float>& wo, const Ray::Hit& hit, int depth, Vec3<float>& throughput,
+                 HemisphereSampling::Sample& sample, Random& rng) {
+        sample = sampleDirection(hit, rng);
+        Vec3<float> response = hit.getMaterial().evaluateColorResponse(hit.interpolatedNormal,
+                                                                          sample.direction, wo);
+        throughput *= response / sample.probability;
+
+        // Russian roulette: paths carrying little energy are stopped early,
+        // the surviving ones are weighted up to keep the estimate unbiased
+        if (russianRoulette && depth + 1 >= rouletteMinDepth) {
+            float survival = std::min(std::max(throughput[0], std::max(throughput[1], throughput[2])), 0.95f);
+            if (rng.nextFloat() >= survival)
+                return false;
+            throughput /= survival;
+        }
 
         return true;
     }
 
-    bool pathTrace(int i, int j, const Image& img, const Scene& scene, Vec3<float>& shading) {
+    // Returns false when the camera ray doesn't hit anything. cameraHit is the hit
+    // of the camera ray when it was already traced, without model for a miss.
+    bool tracePath(const Ray& cameraRay, const Scene& scene, Vec3<float>& shading, Random& rng,
+                   const Ray::Hit* cameraHit = nullptr) {
+        shading = Vec3<float>(0.f, 0.f, 0.f);
+        Vec3<float> throughput(1.f, 1.f, 1.f);
+        Ray ray = cameraRay;
+
+        // Q-table state of the previous bounce
+        int origin = -1;
+        int sampleIndex = -1;
+        // Density of the direction sampled at the previous bounce
+        float directionPdf = 0.f;
+
+        for (int depth = 0; depth < boundDepth; depth++) {
+            Ray::Hit hit;
+            if (depth == 0 && cameraHit) {
+                if (!cameraHit->m)
+                    return false;
+                hit = *cameraHit;
+            } else if (!rayTrace(ray, scene.getModels(), hit)) {
+                return depth > 0;
+            }
+
+            const Material& material = hit.getMaterial();
+            Vec3<float> emitted = material.getEmittedLevel() * material.getColor();
+            Vec3<float> hitShading = emitted;
+
+            shading += throughput * emitted * emissionWeight(hit, ray.getDirection(), depth, directionPdf);
+
+            if (!purePathTracing) { // Direct lighting
+                Vec3<float> direct = computeHitShading(ray, hit, scene, rng);
+                hitShading += direct;
+                shading += throughput * direct;
+            }
+
+            // Update Q-table if learning enabled
+            int nHit = leafId(hit);
+            if (learningLT && origin >= 0 && nHit >= 0 && sampleIndex >= 0)
+                qtable->update(origin, nHit, sampleIndex, hitShading, material, rng);
+
+            if (purePathTracing)
+                if (material.getEmittedLevel() > 0.99) // Considered a light source
+                    break;
+
+            // Nothing left to gather past the last bounce
+            if (depth + 1 == boundDepth)
+                break;
+
+            Vec3<float> hitPosition = ray.getOrigin() + hit.distance*ray.getDirection();
+            if (nextEventEstimation)
+                shading += throughput * sampleEmitters(ray, hit, hitPosition, scene, rng);
+
+            HemisphereSampling::Sample sample;
+            if (!scatter(-ray.getDirection(), hit, depth, throughput, sample, rng))
+                break;
+
+            origin = nHit;
+            sampleIndex = sample.index;
+            directionPdf = sample.probability;
+            ray = Ray::spawn(hitPosition, hit.faceNormal, sample.direction);
+        }
+
+        return boundDepth > 0;
+    }
+
+    // Traces a path through the point of the pixel at the given shift from its
+    // center, falls back to the background when nothing is hit
+    bool tracePixelSample(int i, int j, float xShift, float yShift, const Image& img,
+                          const Scene& scene, Vec3<float>& shading, Random& rng,
+                          const Ray::Hit* cameraHit = nullptr) {
+        if (tracePath(cameraRay(i, j, xShift, yShift, img, scene), scene, shading, rng, cameraHit))
+            return true;
+
+        shading = img(i, j); // background pixel
+        return false;
+    }
+
+    Ray cameraRay(int i, int j, float xShift, float yShift, const Image& img, const Scene& scene) const {
         const Vec3<float>& cameraPosition = scene.getCamera().getPosition();
+        float x = (i + xShift) / (float) img.getWidth();
+        float y = (j + yShift) / (float) img.getHeight();
+        Vec3<float> pixelPosition = scene.getCamera().computePixelPosition(x, y);
+
+        return Ray(cameraPosition, normalize(pixelPosition - cameraPosition));
+    }
+
+    bool pathTrace(int i, int j, const Image& img, const Scene& scene, Vec3<float>& shading, Random& rng) {
         shading = Vec3<float>(0.f, 0.f, 0.f);
 
         bool pathTraced = false;
         int res = std::sqrt(samplesPerPixel);
+        std::vector<Ray> rays;
         for (int k = 0; k < res; k++) {
             for (int l = 0; l < res; l++) {
                 //     // Random numbers between -0.5 and 0.5
@@ -272,80 +1170,107 @@ private:
                 float step = (0.5f / (float) res);
                 float xShift = -0.5f + step + (2.f * k * step);
                 float yShift = -0.5f + step + (2.f * l * step);
+                rays.push_back(cameraRay(i, j, xShift, yShift, img, scene));
+            }
+        }
 
-                float x = (i + xShift) / (float) img.getWidth();
-                float y = (j + yShift) / (float) img.getHeight();
-                Vec3<float> pixelPosition = scene.getCamera().computePixelPosition(x, y);
-
-                Ray ray(cameraPosition, normalize(pixelPosition - cameraPosition));
-                Vec3<float> currentShading(0.f, 0.f, 0.f);
-                if (recursivePathTrace(ray, scene, boundDepth, currentShading))
-                    pathTraced = true;
-                else
-                    currentShading = img(i, j); // add background pixel
+        // The camera rays are coherent, the rest of the paths are traced one by one
+        std::vector<Ray::Hit> hits;
+        traceCameraRays(rays, scene, hits);
+        for (std::size_t k = 0; k < rays.size(); k++) {
+            Vec3<float> currentShading;
+            if (tracePath(rays[k], scene, currentShading, rng, &hits[k]))
+                pathTraced = true;
+            else
+                currentShading = img(i, j); // background pixel
 
-                shading += currentShading;
-            }
+            shading += currentShading;
         }
 
         shading /= res*res;
         return pathTraced;
     }
 
-    bool computePixelShading(const Vec3<float>& pixelPosition, const Scene& scene, Vec3<float>& shading) {
-        const Vec3<float>& cameraPosition = scene.getCamera().getPosition();
-        Ray ray(cameraPosition, normalize(pixelPosition - cameraPosition));
-
-        Ray::Hit hit;
-        if (!rayTrace(ray, scene.getModels(), hit))
-            return false;
-
-        shading = computeHitShading(ray, hit, scene);
-
-        return true;
-    }
-
-    bool antiAliasing(int i, int j, const Image& img, const Scene& scene, Vec3<float>& shading) {
+    bool antiAliasing(int i, int j, const Image& img, const Scene& scene, Vec3<float>& shading, Random& rng) {
         bool result = false;
         int counter = 0;
         shading = Vec3<float>(0.f, 0.f, 0.f);
 
-        #pragma omp parallel for collapse(2)
+        const Vec3<float>& cameraPosition = scene.getCamera().getPosition();
+        std::vector<Ray> rays;
         // for (int ki = -(aaRes/2); ki < aaRes/2; ki++) {
         //     for (int kj = -(aaRes/2); kj < aaRes/2; kj++) {
         for (int ki = 0; ki < aaRes; ki++) {
             for (int kj = 0; kj < aaRes; kj++) {
-                Vec3<float> currentShading;
                 Vec3<float> pixelPosition = scene.getCamera().computePixelPosition(((i*aaRes)+ki) / (float) (img.getWidth()*aaRes), ((j*aaRes)+kj) / (float) (img.getHeight()*aaRes));
-                if (computePixelShading(pixelPosition, scene, currentShading))
-                    result = true;
-                else
-                    currentShading = img(i, j);
-                shading += currentShading;
-                counter++;
+                rays.emplace_back(cameraPosition, normalize(pixelPosition - cameraPosition));
             }
         }
 
+        std::vector<Ray::Hit> hits;
+        traceCameraRays(rays, scene, hits);
+        for (std::size_t k = 0; k < rays.size(); k++) {
+            Vec3<float> currentShading;
+            if (hits[k].m) {
+                currentShading = computeHitShading(rays[k], hits[k], scene, rng);
+                result = true;
+            } else {
+                currentShading = img(i, j);
+            }
+            shading += currentShading;
+            counter++;
+        }
+
         shading /= counter;
         return result;
     }
 
+    // Most samples a pixel can receive in one adaptive round, in units of the minimum
+    static constexpr int adaptiveRoundFactor = 8;
+
     bool shadow;            // Shadows
     bool antialiasing;      // Anti-aliasing
     bool bvh;               // BVH acceleration
     bool pathTracing;       // Path Tracing
     bool purePathTracing;   // Pure Path Tracing (no direct lighting)
+    bool russianRoulette;   // Russian roulette path termination
+    bool nextEventEstimation; // Explicit sampling of the emissive models
+    bool progressive;       // Progressive rendering
+    bool adaptive;          // Adaptive sampling
     bool cosineWeighted;    // Cosine Weighted Sampling
     bool learningLT;        // Learning Light Transport
+    bool rayPackets;        // Packets of camera rays
+    bool watertight;        // Watertight triangle test
+    bool wavefront;         // Wavefront path tracing
 
     int aaRes;              // Anti-aliasing resolution
+    int numberOfThreads;    // 0 for every available core
+    int tileSize;           // Width and height of the tiles, in pixels
+    uint64_t seed;          // Seed of the per-pixel random number generators
 
-    BVH* pBvh;
+    const BVH* pBvh;        // Owned by the scene, kept between renders
     int bvhMinSplit;
-    int boundDepth;
+    BVH::SplitMethod bvhSplitMethod;
+    bool bvhWide;           // Collapsed multi-branching BVH
+    float bvhRebuildThreshold; // SAH cost ratio past which a refitted BVH is rebuilt, 0 to always rebuild
+    double bvhUpdateTime;   // Time spent bringing the BVH up to date before the last render (s)
+    const InstanceBVH* pInstanceBvh; // Two-level BVH of the instances, built with the same settings
+    int boundDepth;         // Maximum number of bounces
+    int rouletteMinDepth;   // Bounces before Russian roulette starts
+    int passSamples;        // Samples per pixel of a progressive pass
+    double timeBudget;      // Progressive rendering time budget (s)
+    float targetVariance;   // Progressive rendering target mean pixel variance
+    std::string snapshotFilename;
+    double snapshotInterval; // Time between two snapshots (s)
+    int adaptiveMinSamples; // Samples of every pixel before adapting
+    int adaptiveBudget;     // Average samples per pixel to spend
+    std::string samplesMapFilename;
     int samplesPerPixel;
+    int wavefrontPaths;     // Paths of a wavefront batch
     HemisphereSampling* pHemisphereSampling;
+    EmitterSampling emitterSampling;
     Qtable* qtable;
+    std::string qtableSnapshot; // Q-table loaded before and saved after rendering
 };
 
 #endif
\ No newline at end of file
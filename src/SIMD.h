@@ -0,0 +1,161 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+/*
+* Minimal SIMD wrappers: 8 floats with AVX2 (-DUSE_AVX2=ON), 4 floats with SSE,
+* and a plain array fallback for other architectures.
+*/
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_WIDTH 8
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SIMD_WIDTH 4
+#define SIMD_SSE
+#else
+#include <cmath>
+#include <algorithm>
+#define SIMD_WIDTH 4
+#define SIMD_SCALAR
+#endif
+
+namespace simd {
+
+#if SIMD_WIDTH == 8
+
+struct vmask {
+    __m256 v;
+    vmask() = default;
+    vmask(__m256 v): v(v) {}
+    int bits() const { return _mm256_movemask_ps(v); }
+};
+
+struct vfloat {
+    __m256 v;
+    vfloat() = default;
+    vfloat(__m256 v): v(v) {}
+    vfloat(float f): v(_mm256_set1_ps(f)) {}
+    static vfloat load(const float* p) { return _mm256_load_ps(p); }
+    static vfloat loadu(const float* p) { return _mm256_loadu_ps(p); }
+    void store(float* p) const { _mm256_store_ps(p, v); }
+};
+
+inline vfloat operator+(vfloat a, vfloat b) { return _mm256_add_ps(a.v, b.v); }
+inline vfloat operator-(vfloat a, vfloat b) { return _mm256_sub_ps(a.v, b.v); }
+inline vfloat operator*(vfloat a, vfloat b) { return _mm256_mul_ps(a.v, b.v); }
+inline vfloat operator/(vfloat a, vfloat b) { return _mm256_div_ps(a.v, b.v); }
+inline vfloat min(vfloat a, vfloat b) { return _mm256_min_ps(a.v, b.v); }
+inline vfloat max(vfloat a, vfloat b) { return _mm256_max_ps(a.v, b.v); }
+inline vfloat abs(vfloat a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.f), a.v); }
+inline vmask operator<(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline vmask operator<=(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+inline vmask operator>(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+inline vmask operator>=(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+inline vmask operator==(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_EQ_OQ); }
+inline vmask operator&(vmask a, vmask b) { return _mm256_and_ps(a.v, b.v); }
+inline vmask operator|(vmask a, vmask b) { return _mm256_or_ps(a.v, b.v); }
+inline vmask andnot(vmask a, vmask b) { return _mm256_andnot_ps(a.v, b.v); } // ~a & b
+inline vfloat select(vmask m, vfloat a, vfloat b) { return _mm256_blendv_ps(b.v, a.v, m.v); }
+
+#elif defined(SIMD_SSE)
+
+struct vmask {
+    __m128 v;
+    vmask() = default;
+    vmask(__m128 v): v(v) {}
+    int bits() const { return _mm_movemask_ps(v); }
+};
+
+struct vfloat {
+    __m128 v;
+    vfloat() = default;
+    vfloat(__m128 v): v(v) {}
+    vfloat(float f): v(_mm_set1_ps(f)) {}
+    static vfloat load(const float* p) { return _mm_load_ps(p); }
+    static vfloat loadu(const float* p) { return _mm_loadu_ps(p); }
+    void store(float* p) const { _mm_store_ps(p, v); }
+};
+
+inline vfloat operator+(vfloat a, vfloat b) { return _mm_add_ps(a.v, b.v); }
+inline vfloat operator-(vfloat a, vfloat b) { return _mm_sub_ps(a.v, b.v); }
+inline vfloat operator*(vfloat a, vfloat b) { return _mm_mul_ps(a.v, b.v); }
+inline vfloat operator/(vfloat a, vfloat b) { return _mm_div_ps(a.v, b.v); }
+inline vfloat min(vfloat a, vfloat b) { return _mm_min_ps(a.v, b.v); }
+inline vfloat max(vfloat a, vfloat b) { return _mm_max_ps(a.v, b.v); }
+inline vfloat abs(vfloat a) { return _mm_andnot_ps(_mm_set1_ps(-0.f), a.v); }
+inline vmask operator<(vfloat a, vfloat b) { return _mm_cmplt_ps(a.v, b.v); }
+inline vmask operator<=(vfloat a, vfloat b) { return _mm_cmple_ps(a.v, b.v); }
+inline vmask operator>(vfloat a, vfloat b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline vmask operator>=(vfloat a, vfloat b) { return _mm_cmpge_ps(a.v, b.v); }
+inline vmask operator==(vfloat a, vfloat b) { return _mm_cmpeq_ps(a.v, b.v); }
+inline vmask operator&(vmask a, vmask b) { return _mm_and_ps(a.v, b.v); }
+inline vmask operator|(vmask a, vmask b) { return _mm_or_ps(a.v, b.v); }
+inline vmask andnot(vmask a, vmask b) { return _mm_andnot_ps(a.v, b.v); } // ~a & b
+inline vfloat select(vmask m, vfloat a, vfloat b) {
+    return _mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v));
+}
+
+#else
+
+struct vmask {
+    bool v[SIMD_WIDTH];
+    int bits() const {
+        int b = 0;
+        for (int i = 0; i < SIMD_WIDTH; i++)
+            b |= v[i] << i;
+        return b;
+    }
+};
+
+struct vfloat {
+    float v[SIMD_WIDTH];
+    vfloat() = default;
+    vfloat(float f) { for (int i = 0; i < SIMD_WIDTH; i++) v[i] = f; }
+    static vfloat load(const float* p) { vfloat r; for (int i = 0; i < SIMD_WIDTH; i++) r.v[i] = p[i]; return r; }
+    static vfloat loadu(const float* p) { return load(p); }
+    void store(float* p) const { for (int i = 0; i < SIMD_WIDTH; i++) p[i] = v[i]; }
+};
+
+#define SIMD_SCALAR_OP(name, T, expr) \
+    inline T name(vfloat a, vfloat b) { T r; for (int i = 0; i < SIMD_WIDTH; i++) r.v[i] = (expr); return r; }
+SIMD_SCALAR_OP(operator+, vfloat, a.v[i] + b.v[i])
+SIMD_SCALAR_OP(operator-, vfloat, a.v[i] - b.v[i])
+SIMD_SCALAR_OP(operator*, vfloat, a.v[i] * b.v[i])
+SIMD_SCALAR_OP(operator/, vfloat, a.v[i] / b.v[i])
+SIMD_SCALAR_OP(min, vfloat, a.v[i] < b.v[i] ? a.v[i] : b.v[i])
+SIMD_SCALAR_OP(max, vfloat, a.v[i] > b.v[i] ? a.v[i] : b.v[i])
+SIMD_SCALAR_OP(operator<, vmask, a.v[i] < b.v[i])
+SIMD_SCALAR_OP(operator<=, vmask, a.v[i] <= b.v[i])
+SIMD_SCALAR_OP(operator>, vmask, a.v[i] > b.v[i])
+SIMD_SCALAR_OP(operator>=, vmask, a.v[i] >= b.v[i])
+SIMD_SCALAR_OP(operator==, vmask, a.v[i] == b.v[i])
+#undef SIMD_SCALAR_OP
+
+inline vfloat abs(vfloat a) { vfloat r; for (int i = 0; i < SIMD_WIDTH; i++) r.v[i] = std::fabs(a.v[i]); return r; }
+inline vmask operator&(vmask a, vmask b) { vmask r; for (int i = 0; i < SIMD_WIDTH; i++) r.v[i] = a.v[i] && b.v[i]; return r; }
+inline vmask operator|(vmask a, vmask b) { vmask r; for (int i = 0; i < SIMD_WIDTH; i++) r.v[i] = a.v[i] || b.v[i]; return r; }
+inline vmask andnot(vmask a, vmask b) { vmask r; for (int i = 0; i < SIMD_WIDTH; i++) r.v[i] = !a.v[i] && b.v[i]; return r; }
+inline vfloat select(vmask m, vfloat a, vfloat b) { vfloat r; for (int i = 0; i < SIMD_WIDTH; i++) r.v[i] = m.v[i] ? a.v[i] : b.v[i]; return r; }
+
+#endif
+
+inline vfloat& operator+=(vfloat& a, vfloat b) { a = a + b; return a; }
+
+// Vector of SIMD_WIDTH 3D vectors
+struct vvec3 {
+    vfloat x, y, z;
+    vvec3() = default;
+    vvec3(vfloat x, vfloat y, vfloat z): x(x), y(y), z(z) {}
+    vvec3(float x, float y, float z): x(x), y(y), z(z) {}
+};
+
+inline vvec3 operator-(const vvec3& a, const vvec3& b) { return vvec3(a.x - b.x, a.y - b.y, a.z - b.z); }
+inline vfloat dot(const vvec3& a, const vvec3& b) { return a.x*b.x + a.y*b.y + a.z*b.z; }
+inline vvec3 cross(const vvec3& a, const vvec3& b) {
+    return vvec3(a.y*b.z - a.z*b.y, a.z*b.x - a.x*b.z, a.x*b.y - a.y*b.x);
+}
+
+}
+
+#endif
\ No newline at end of file
@@ -4,7 +4,10 @@
 #include <vector>
 #include "Camera.h"
 #include "Model.h"
+#include "Instance.h"
 #include "Light.h"
+#include "SceneBVH.h"
+#include "Hash.h"
 
 class Scene {
 public:
@@ -14,19 +17,46 @@ public:
         models.push_back(&model);
     }
 
+    void add(Instance& instance) {
+        instances.push_back(&instance);
+    }
+
     void add(Light& light) {
         ligths.push_back(&light);
     }
 
     const Camera& getCamera() const { return camera; }
     const std::vector<Model*>& getModels() const { return models; }
+    const std::vector<Instance*>& getInstances() const { return instances; }
     const std::vector<Light*>& getLights() const { return ligths; }
     const Vec3<float>& getCameraPosition() const { return camera.getPosition(); }
+    // Kept between renders, so that only what moved is refitted or rebuilt
+    SceneBVH& getAccelerationStructure() { return accelerationStructure; }
+
+    // Hash of the geometry of the models, in the order they were added
+    uint64_t computeHash() const {
+        uint64_t hash = hashValue(models.size());
+        for (const Model* model: models) {
+            const auto& vertices = model->getVertices();
+            const auto& indices = model->getIndices();
+            hash = hashValue(vertices.size(), hash);
+            hash = hashBytes(vertices.data(), vertices.size() * sizeof(Vec3<float>), hash);
+            hash = hashValue(indices.size(), hash);
+            hash = hashBytes(indices.data(), indices.size() * sizeof(Vec3<int>), hash);
+        }
+        for (const Instance* instance: instances) {
+            hash = hashValue(instance->getMesh().getIndices().size(), hash);
+            hash = hashValue(instance->getTransform(), hash);
+        }
+        return hash;
+    }
 
 private:
     Camera camera;
     std::vector<Model*> models;
+    std::vector<Instance*> instances;
     std::vector<Light*> ligths;
+    SceneBVH accelerationStructure;
 };
 
 #endif
\ No newline at end of file
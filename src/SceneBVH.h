@@ -0,0 +1,166 @@
+#ifndef SCENE_BVH_H
+#define SCENE_BVH_H
+
+#include <memory>
+#include <omp.h>
+#include "BVH.h"
+#include "InstanceBVH.h"
+
+/*
+* Acceleration structures of a scene, kept from one render to the next. Before
+* each frame, update() compares the scene with what the structures were built on:
+* unchanged geometry is reused as is, moved vertices are refitted in O(n), and
+* the trees are only rebuilt when the refit degrades their SAH cost too much or
+* when the triangles themselves changed.
+*/
+class SceneBVH {
+public:
+    struct Settings {
+        int minSplit = 100;
+        BVH::SplitMethod splitMethod = BVH::SplitMethod::Middle;
+        bool wide = false;
+        bool watertight = false;
+
+        bool operator==(const Settings& other) const {
+            return minSplit == other.minSplit && splitMethod == other.splitMethod
+                && wide == other.wide && watertight == other.watertight;
+        }
+        bool operator!=(const Settings& other) const { return !(*this == other); }
+    };
+
+    SceneBVH() = default;
+    SceneBVH(const SceneBVH&) = delete;
+    SceneBVH& operator=(const SceneBVH&) = delete;
+
+    // Brings the structures up to date with the models (in a BVH when modelsBVH) and
+    // the instances. With rebuildThreshold > 0 moved geometry is refitted, and rebuilt
+    // once its SAH cost exceeds rebuildThreshold times its cost when built; with
+    // rebuildThreshold <= 0 it is always rebuilt.
+    void update(const std::vector<Model*>& models, const std::vector<Instance*>& instances,
+                bool modelsBVH, const Settings& newSettings, float rebuildThreshold) {
+        double start = omp_get_wtime();
+        bool settingsChanged = newSettings != settings;
+        settings = newSettings;
+        std::string modelsAction = updateModels(modelsBVH ? models : std::vector<Model*>(),
+                                                settingsChanged, rebuildThreshold);
+        std::string instancesAction = updateInstances(instances, settingsChanged, rebuildThreshold);
+        updateTime = omp_get_wtime() - start;
+        frames++;
+
+        std::cout << "SceneBVH.h" << std::endl;
+        std::cout << "      Frame:              " << frames << std::endl;
+        if (pBvh) {
+            std::cout << "      Models BVH:         " << modelsAction << std::endl;
+            std::cout << "      SAH cost:           " << pBvh->getSAHCost()
+                      << " (" << pBvh->getBuildSAHCost() << " when built)" << std::endl;
+        }
+        if (pInstanceBvh)
+            std::cout << "      Instances BVH:      " << instancesAction << std::endl;
+        std::cout << "      Update time (ms):   " << updateTime * 1000. << std::endl;
+    }
+
+    // nullptr when there is nothing to trace through it
+    const BVH* getBVH() const { return pBvh.get(); }
+    const InstanceBVH* getInstanceBVH() const { return pInstanceBvh.get(); }
+    // Time spent by the last update(), in seconds
+    double getUpdateTime() const { return updateTime; }
+
+private:
+    std::string updateModels(const std::vector<Model*>& models, bool settingsChanged, float rebuildThreshold) {
+        if (models.empty()) {
+            pBvh.reset();
+            modelStates.clear();
+            return "none";
+        }
+
+        std::vector<ModelState> states;
+        for (const Model* model: models)
+            states.push_back({model, model->getIndices().size(), model->getVersion()});
+
+        bool sameTriangles = pBvh && !settingsChanged && states.size() == modelStates.size();
+        bool moved = false;
+        for (std::size_t i = 0; sameTriangles && i < states.size(); i++) {
+            sameTriangles = states[i].model == modelStates[i].model
+                         && states[i].numberOfTriangles == modelStates[i].numberOfTriangles;
+            moved = moved || states[i].version != modelStates[i].version;
+        }
+        modelStates = states;
+
+        if (sameTriangles && !moved)
+            return "unchanged";
+
+        if (sameTriangles && rebuildThreshold > 0.f) {
+            float cost = pBvh->refit();
+            if (cost <= rebuildThreshold * pBvh->getBuildSAHCost())
+                return "refitted";
+        }
+
+        pBvh.reset();    // before building the new one, to bound the memory
+        pBvh = std::make_unique<BVH>(models, settings.minSplit, settings.splitMethod,
+                                     settings.wide, settings.watertight);
+        return sameTriangles ? "rebuilt" : "built";
+    }
+
+    std::string updateInstances(const std::vector<Instance*>& instances, bool settingsChanged,
+                                float rebuildThreshold) {
+        if (instances.empty()) {
+            pInstanceBvh.reset();
+            instanceStates.clear();
+            return "none";
+        }
+
+        std::vector<InstanceState> states;
+        for (const Instance* instance: instances)
+            states.push_back({instance, instance->getVersion(), instance->getMesh().getVersion(),
+                              instance->getMesh().getIndices().size()});
+
+        bool sameInstances = pInstanceBvh && !settingsChanged && states.size() == instanceStates.size();
+        bool moved = false;
+        for (std::size_t i = 0; sameInstances && i < states.size(); i++) {
+            sameInstances = states[i].instance == instanceStates[i].instance
+                         && states[i].numberOfTriangles == instanceStates[i].numberOfTriangles;
+            moved = moved || states[i].version != instanceStates[i].version
+                          || states[i].meshVersion != instanceStates[i].meshVersion;
+        }
+        instanceStates = states;
+
+        if (sameInstances && !moved)
+            return "unchanged";
+
+        if (sameInstances) {
+            int refitted;
+            int rebuilt = pInstanceBvh->update(rebuildThreshold, refitted);
+            return "top level rebuilt, " + std::to_string(refitted) + " mesh(es) refitted, "
+                   + std::to_string(rebuilt) + " rebuilt";
+        }
+
+        pInstanceBvh.reset();
+        pInstanceBvh = std::make_unique<InstanceBVH>(instances, settings.minSplit, settings.splitMethod,
+                                                     settings.wide, settings.watertight);
+        return "built";
+    }
+
+    // What the structures were built on
+    struct ModelState {
+        const Model* model;
+        std::size_t numberOfTriangles;
+        uint64_t version;
+    };
+
+    struct InstanceState {
+        const Instance* instance;
+        uint64_t version;
+        uint64_t meshVersion;
+        std::size_t numberOfTriangles;
+    };
+
+    Settings settings;
+    std::unique_ptr<BVH> pBvh;
+    std::unique_ptr<InstanceBVH> pInstanceBvh;
+    std::vector<ModelState> modelStates;
+    std::vector<InstanceState> instanceStates;
+    double updateTime = 0.;
+    int frames = 0;
+};
+
+#endif
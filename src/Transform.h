@@ -0,0 +1,133 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include <cmath>
+#include <algorithm>
+#include "Vec3.h"
+#include "AABB.h"
+
+/*
+* Affine transform: a 3x3 linear part and a translation. Transforms are built
+* from translations, rotations and scalings, whose inverses are known, so the
+* inverse is composed alongside and never computed from the matrix.
+*/
+class Transform {
+public:
+    Transform() {
+        setIdentity(m);
+        setIdentity(inv);
+    }
+
+    static Transform translation(const Vec3<float>& t) {
+        Transform transform;
+        for (int i = 0; i < 3; i++) {
+            transform.m[i][3] = t[i];
+            transform.inv[i][3] = -t[i];
+        }
+        return transform;
+    }
+
+    static Transform scaling(const Vec3<float>& s) {
+        Transform transform;
+        for (int i = 0; i < 3; i++) {
+            transform.m[i][i] = s[i];
+            transform.inv[i][i] = 1.f / s[i];
+        }
+        return transform;
+    }
+
+    // Rotation of angle radians around the axis (Rodrigues' formula), its inverse is its transpose
+    static Transform rotation(const Vec3<float>& axis, float angle) {
+        Vec3<float> a = normalize(axis);
+        float c = std::cos(angle);
+        float s = std::sin(angle);
+        float r[3][3] = {{c + a[0]*a[0]*(1.f - c), a[0]*a[1]*(1.f - c) - a[2]*s, a[0]*a[2]*(1.f - c) + a[1]*s},
+                         {a[1]*a[0]*(1.f - c) + a[2]*s, c + a[1]*a[1]*(1.f - c), a[1]*a[2]*(1.f - c) - a[0]*s},
+                         {a[2]*a[0]*(1.f - c) - a[1]*s, a[2]*a[1]*(1.f - c) + a[0]*s, c + a[2]*a[2]*(1.f - c)}};
+        Transform transform;
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                transform.m[i][j] = r[i][j];
+                transform.inv[i][j] = r[j][i];
+            }
+        }
+        return transform;
+    }
+
+    // Applies other first, then this
+    Transform operator*(const Transform& other) const {
+        Transform transform;
+        multiply(m, other.m, transform.m);
+        multiply(other.inv, inv, transform.inv);
+        return transform;
+    }
+
+    Transform inverse() const {
+        Transform transform;
+        std::copy(&inv[0][0], &inv[0][0] + 12, &transform.m[0][0]);
+        std::copy(&m[0][0], &m[0][0] + 12, &transform.inv[0][0]);
+        return transform;
+    }
+
+    Vec3<float> applyToPoint(const Vec3<float>& p) const {
+        return Vec3<float>(m[0][0]*p[0] + m[0][1]*p[1] + m[0][2]*p[2] + m[0][3],
+                           m[1][0]*p[0] + m[1][1]*p[1] + m[1][2]*p[2] + m[1][3],
+                           m[2][0]*p[0] + m[2][1]*p[1] + m[2][2]*p[2] + m[2][3]);
+    }
+
+    Vec3<float> applyToVector(const Vec3<float>& v) const {
+        return Vec3<float>(m[0][0]*v[0] + m[0][1]*v[1] + m[0][2]*v[2],
+                           m[1][0]*v[0] + m[1][1]*v[1] + m[1][2]*v[2],
+                           m[2][0]*v[0] + m[2][1]*v[1] + m[2][2]*v[2]);
+    }
+
+    // Determinant of the linear part: the factor scaling volumes, and so the triple
+    // product of any three vectors it transforms
+    float determinant() const {
+        return m[0][0]*(m[1][1]*m[2][2] - m[1][2]*m[2][1])
+             - m[0][1]*(m[1][0]*m[2][2] - m[1][2]*m[2][0])
+             + m[0][2]*(m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+    }
+
+    // Normals go through the transpose of the inverse to stay orthogonal to the
+    // surface under non-uniform scaling, they have to be normalized again
+    Vec3<float> applyToNormal(const Vec3<float>& n) const {
+        return Vec3<float>(inv[0][0]*n[0] + inv[1][0]*n[1] + inv[2][0]*n[2],
+                           inv[0][1]*n[0] + inv[1][1]*n[1] + inv[2][1]*n[2],
+                           inv[0][2]*n[0] + inv[1][2]*n[1] + inv[2][2]*n[2]);
+    }
+
+    // Box holding the 8 transformed corners of aabb
+    AABB applyToAABB(const AABB& aabb) const {
+        AABB transformed;
+        if (aabb.isEmpty())
+            return transformed;
+
+        for (int corner = 0; corner < 8; corner++)
+            transformed.update(applyToPoint(Vec3<float>(aabb[corner & 1][0], aabb[(corner >> 1) & 1][1], aabb[corner >> 2][2])));
+        return transformed;
+    }
+
+private:
+    static void setIdentity(float matrix[3][4]) {
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 4; j++)
+                matrix[i][j] = i == j ? 1.f : 0.f;
+    }
+
+    // out = a * b, the implicit last row of both is (0, 0, 0, 1)
+    static void multiply(const float a[3][4], const float b[3][4], float out[3][4]) {
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 4; j++) {
+                out[i][j] = a[i][0]*b[0][j] + a[i][1]*b[1][j] + a[i][2]*b[2][j];
+                if (j == 3)
+                    out[i][j] += a[i][3];
+            }
+        }
+    }
+
+    float m[3][4];      // world from object
+    float inv[3][4];    // object from world
+};
+
+#endif
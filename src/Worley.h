@@ -3,11 +3,12 @@
 
 #include <vector>
 #include "Vec3.h"
+#include "Random.h"
 
 class Worley {
 public:
-    Worley(int n, float resX, float resY, float resZ) : resX(resX), resY(resY), resZ(resZ) {
-        generate(n);
+    Worley(int n, float resX, float resY, float resZ, uint64_t seed = 0) : resX(resX), resY(resY), resZ(resZ) {
+        generate(n, seed);
     };
 
     float eval(const Vec3<float>& p) const {
@@ -26,11 +27,12 @@ public:
     }
 
 private:
-    void generate(int n) {
+    void generate(int n, uint64_t seed) {
+        Random rng(seed);
         for (int i = 0; i < n; i++) {
-            float x = ((static_cast <float> (rand()) / (static_cast <float> (RAND_MAX))) - 0.5f)*2.f;
-            float y = ((static_cast <float> (rand()) / (static_cast <float> (RAND_MAX))) - 0.5f)*2.f;
-            float z = ((static_cast <float> (rand()) / (static_cast <float> (RAND_MAX))) - 0.5f)*2.f;
+            float x = (rng.nextFloat() - 0.5f)*2.f;
+            float y = (rng.nextFloat() - 0.5f)*2.f;
+            float z = (rng.nextFloat() - 0.5f)*2.f;
             featurePoints.push_back(Vec3<float>(x, y, z));
         }
     }